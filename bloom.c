@@ -0,0 +1,133 @@
+/* Counting Bloom filter with 4-bit counters */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "bloom.h"
+
+/* Counters per expected string, and smallest number of counters */
+#define BLOOM_RATIO 8
+#define BLOOM_MIN_COUNTERS 1024
+
+#define COUNTER_MAX 15
+
+struct bloom {
+    uint8_t *counter; /* Two 4-bit counters per byte */
+    size_t mask;      /* Number of counters minus one */
+    size_t capacity;
+    size_t collisions; /* Strings added while they seemed present */
+};
+
+/* Finalizer of splitmix64, spreading every input bit over the whole word */
+static inline uint64_t bloom_mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* Derive the counters of a string by double hashing two 64-bit hashes mixed
+ * from its FNV-1a hash. The slots are computed on 64 bits so that arrays of
+ * more than 2^32 counters are covered in full.
+ */
+static void bloom_slots(const bloom_t *b, const char *s, size_t *slot)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 0x100000001b3ULL;
+    }
+
+    uint64_t h1 = bloom_mix(h), h2 = bloom_mix(h ^ 0x9e3779b97f4a7c15ULL) | 1;
+    for (int i = 0; i < BLOOM_HASHES; i++)
+        slot[i] = (size_t) ((h1 + (uint64_t) i * h2) & b->mask);
+}
+
+static inline unsigned get_counter(const bloom_t *b, size_t i)
+{
+    return (b->counter[i >> 1] >> ((i & 1) * 4)) & 0xf;
+}
+
+static inline void set_counter(bloom_t *b, size_t i, unsigned v)
+{
+    unsigned shift = (i & 1) * 4;
+    b->counter[i >> 1] = (b->counter[i >> 1] & ~(0xf << shift)) | v << shift;
+}
+
+bloom_t *bloom_new(size_t capacity)
+{
+    bloom_t *b = malloc(sizeof(bloom_t));
+    if (!b)
+        return NULL;
+
+    size_t n = BLOOM_MIN_COUNTERS;
+    while (n < capacity * BLOOM_RATIO)
+        n <<= 1;
+    b->counter = calloc(n / 2, 1);
+    if (!b->counter) {
+        free(b);
+        return NULL;
+    }
+    b->mask = n - 1;
+    b->capacity = n / BLOOM_RATIO;
+    b->collisions = 0;
+    return b;
+}
+
+void bloom_free(bloom_t *b)
+{
+    if (!b)
+        return;
+    free(b->counter);
+    free(b);
+}
+
+size_t bloom_capacity(const bloom_t *b)
+{
+    return b->capacity;
+}
+
+void bloom_add(bloom_t *b, const char *s)
+{
+    size_t slot[BLOOM_HASHES];
+    bool present = true;
+
+    bloom_slots(b, s, slot);
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        unsigned v = get_counter(b, slot[i]);
+        present = present && v;
+        if (v < COUNTER_MAX)
+            set_counter(b, slot[i], v + 1);
+    }
+    b->collisions += present;
+}
+
+void bloom_remove(bloom_t *b, const char *s)
+{
+    size_t slot[BLOOM_HASHES];
+
+    /* A saturated counter has lost track of its count, so it stays set */
+    bloom_slots(b, s, slot);
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        unsigned v = get_counter(b, slot[i]);
+        if (v && v < COUNTER_MAX)
+            set_counter(b, slot[i], v - 1);
+    }
+}
+
+bool bloom_maybe(const bloom_t *b, const char *s)
+{
+    size_t slot[BLOOM_HASHES];
+
+    bloom_slots(b, s, slot);
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        if (!get_counter(b, slot[i]))
+            return false;
+    }
+    return true;
+}
+
+bool bloom_distinct(const bloom_t *b)
+{
+    return !b->collisions;
+}
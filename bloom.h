@@ -0,0 +1,46 @@
+#ifndef LAB0_BLOOM_H
+#define LAB0_BLOOM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Counting Bloom filter over the strings of a queue.
+ *
+ * Every string sets BLOOM_HASHES counters out of a power-of-two array of 4-bit
+ * counters, sized for eight counters per expected string. A string whose
+ * counters are not all set was never added, so absence is answered in O(1)
+ * without false negatives. Removing a string decrements its counters, except
+ * those which saturated, so removals never introduce false negatives either.
+ *
+ * The filter also remembers whether any string was added while it already
+ * seemed present. If none was, the strings added so far are all distinct.
+ */
+
+#define BLOOM_HASHES 4
+
+typedef struct bloom bloom_t;
+
+/* Create an empty filter sized for capacity strings.
+ * Return NULL if allocation failed.
+ */
+bloom_t *bloom_new(size_t capacity);
+
+/* Release the filter */
+void bloom_free(bloom_t *b);
+
+/* Number of strings the filter was sized for */
+size_t bloom_capacity(const bloom_t *b);
+
+/* Record string s */
+void bloom_add(bloom_t *b, const char *s);
+
+/* Forget one occurrence of string s, which must have been added */
+void bloom_remove(bloom_t *b, const char *s);
+
+/* Return false if s is definitely absent, true if it may be present */
+bool bloom_maybe(const bloom_t *b, const char *s);
+
+/* Return true if no added string could be a duplicate of an earlier one */
+bool bloom_distinct(const bloom_t *b);
+
+#endif /* LAB0_BLOOM_H */
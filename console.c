@@ -1,9 +1,11 @@
 /* Implementation of simple command-line interface */
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -295,6 +297,36 @@ bool get_int(char *vname, int *loc)
     return true;
 }
 
+/* Extract a count, possibly beyond the range of int, and store at loc */
+bool get_size(char *vname, size_t *loc)
+{
+    char *end = NULL;
+    /* strtoull() would silently negate a value with a minus sign */
+    if (*vname == '-')
+        return false;
+    errno = 0;
+    unsigned long long v = strtoull(vname, &end, 0);
+    if (errno || end == vname || *end != '\0' || v > SIZE_MAX)
+        return false;
+
+    *loc = (size_t) v;
+    return true;
+}
+
+/* Extract a signed count, possibly beyond the range of int, and store at loc */
+bool get_ssize(char *vname, ssize_t *loc)
+{
+    char *end = NULL;
+    errno = 0;
+    long long v = strtoll(vname, &end, 0);
+    if (errno || end == vname || *end != '\0' || v < -SSIZE_MAX ||
+        v > SSIZE_MAX)
+        return false;
+
+    *loc = (ssize_t) v;
+    return true;
+}
+
 static bool do_option(int argc, char *argv[])
 {
     if (argc == 1) {
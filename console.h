@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <sys/select.h>
+#include <sys/types.h>
 
 #include "linenoise.h"
 
@@ -53,6 +54,12 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter);
 /* Extract integer from text and store at loc */
 bool get_int(char *vname, int *loc);
 
+/* Extract count or signed count from text and store at loc, accepting values
+ * beyond the range of int
+ */
+bool get_size(char *vname, size_t *loc);
+bool get_ssize(char *vname, ssize_t *loc);
+
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf);
 
@@ -83,13 +83,13 @@ bool measure(int64_t *before_ticks,
             dut_insert_head(
                 get_random_string(),
                 *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
+            size_t before_size = q_size(l);
             before_ticks[i] = cpucycles();
             dut_insert_head(s, 1);
             after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
+            size_t after_size = q_size(l);
             dut_free();
-            if (before_size != after_size - 1)
+            if (before_size + 1 != after_size)
                 return false;
         }
         break;
@@ -100,13 +100,13 @@ bool measure(int64_t *before_ticks,
             dut_insert_head(
                 get_random_string(),
                 *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
+            size_t before_size = q_size(l);
             before_ticks[i] = cpucycles();
             dut_insert_tail(s, 1);
             after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
+            size_t after_size = q_size(l);
             dut_free();
-            if (before_size != after_size - 1)
+            if (before_size + 1 != after_size)
                 return false;
         }
         break;
@@ -116,11 +116,11 @@ bool measure(int64_t *before_ticks,
             dut_insert_head(
                 get_random_string(),
                 *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
+            size_t before_size = q_size(l);
             before_ticks[i] = cpucycles();
             element_t *e = q_remove_head(l, NULL, 0);
             after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
+            size_t after_size = q_size(l);
             if (e)
                 q_release_element(e);
             dut_free();
@@ -134,11 +134,11 @@ bool measure(int64_t *before_ticks,
             dut_insert_head(
                 get_random_string(),
                 *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
+            size_t before_size = q_size(l);
             before_ticks[i] = cpucycles();
             element_t *e = q_remove_tail(l, NULL, 0);
             after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
+            size_t after_size = q_size(l);
             if (e)
                 q_release_element(e);
             dut_free();
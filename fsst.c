@@ -0,0 +1,259 @@
+/* Static symbol table string compression */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fsst.h"
+
+/* Number of training rounds. Each round can merge pairs of adjacent symbols,
+ * so five rounds are enough to grow symbols up to FSST_SYMBOL_LEN bytes.
+ */
+#define FSST_ROUNDS 5
+
+/* Symbol identifiers used while training: the codes of the current table
+ * followed by the 256 possible literal bytes.
+ */
+#define N_IDS (FSST_MAX_SYMBOLS + 256)
+
+typedef struct {
+    uint8_t bytes[FSST_SYMBOL_LEN];
+    uint8_t len;
+    uint64_t gain;
+} candidate_t;
+
+/* Find the longest symbol matching at s, given that n bytes remain.
+ * Return its code, or FSST_ESCAPE if there is no matching symbol.
+ */
+static inline unsigned find_symbol(const fsst_table_t *t,
+                                   const uint8_t *s,
+                                   size_t n)
+{
+    for (unsigned i = t->first[*s]; i < t->first[*s + 1]; i++) {
+        unsigned code = t->by_first[i];
+        if (t->len[code] <= n && !memcmp(t->symbol[code], s, t->len[code]))
+            return code;
+    }
+    return FSST_ESCAPE;
+}
+
+/* Group codes by first byte, ordered by decreasing length within a group */
+static void build_index(fsst_table_t *t)
+{
+    uint16_t fill[256];
+
+    memset(t->first, 0, sizeof(t->first));
+    for (unsigned c = 0; c < t->n_symbols; c++)
+        t->first[t->symbol[c][0] + 1]++;
+    for (unsigned b = 0; b < 256; b++)
+        t->first[b + 1] += t->first[b];
+
+    memcpy(fill, t->first, sizeof(fill));
+    for (unsigned c = 0; c < t->n_symbols; c++) {
+        unsigned b = t->symbol[c][0];
+        unsigned i = fill[b]++;
+        while (i > t->first[b] && t->len[t->by_first[i - 1]] < t->len[c]) {
+            t->by_first[i] = t->by_first[i - 1];
+            i--;
+        }
+        t->by_first[i] = c;
+    }
+}
+
+static int cmp_bytes(const void *a, const void *b)
+{
+    const candidate_t *ca = a, *cb = b;
+    if (ca->len != cb->len)
+        return ca->len - cb->len;
+    return memcmp(ca->bytes, cb->bytes, ca->len);
+}
+
+static int cmp_gain(const void *a, const void *b)
+{
+    const candidate_t *ca = a, *cb = b;
+    if (ca->gain != cb->gain)
+        return ca->gain < cb->gain ? 1 : -1;
+    return cmp_bytes(a, b);
+}
+
+/* Get the bytes represented by a training identifier */
+static const uint8_t *id_bytes(const fsst_table_t *t,
+                               unsigned id,
+                               uint8_t *literal,
+                               unsigned *len)
+{
+    if (id < FSST_MAX_SYMBOLS) {
+        *len = t->len[id];
+        return t->symbol[id];
+    }
+    *literal = id - FSST_MAX_SYMBOLS;
+    *len = 1;
+    return literal;
+}
+
+/* Encode the samples with the current table, counting how often each symbol
+ * and each pair of adjacent symbols occurs.
+ */
+static void count_symbols(const fsst_table_t *t,
+                          const char *const *samples,
+                          size_t n,
+                          uint32_t *count1,
+                          uint32_t *count2)
+{
+    memset(count1, 0, N_IDS * sizeof(uint32_t));
+    memset(count2, 0, (size_t) N_IDS * N_IDS * sizeof(uint32_t));
+
+    for (size_t i = 0; i < n; i++) {
+        const uint8_t *s = (const uint8_t *) samples[i];
+        size_t len = strlen(samples[i]);
+        unsigned prev = N_IDS;
+        while (len) {
+            unsigned id, step;
+            unsigned code = find_symbol(t, s, len);
+            if (code == FSST_ESCAPE) {
+                id = FSST_MAX_SYMBOLS + *s;
+                step = 1;
+            } else {
+                id = code;
+                step = t->len[code];
+            }
+            count1[id]++;
+            if (prev != N_IDS)
+                count2[prev * N_IDS + id]++;
+            prev = id;
+            s += step;
+            len -= step;
+        }
+    }
+}
+
+bool fsst_train(fsst_table_t *t, const char *const *samples, size_t n)
+{
+    uint32_t *count1 = malloc(N_IDS * sizeof(uint32_t));
+    uint32_t *count2 = malloc((size_t) N_IDS * N_IDS * sizeof(uint32_t));
+    if (!count1 || !count2) {
+        free(count1);
+        free(count2);
+        return false;
+    }
+
+    bool ok = true;
+    t->n_symbols = 0;
+    build_index(t);
+
+    for (int round = 0; ok && round < FSST_ROUNDS; round++) {
+        count_symbols(t, samples, n, count1, count2);
+
+        /* Every symbol in use and every concatenation of two adjacent
+         * symbols is a candidate for the next table.
+         */
+        size_t n_cand = 0;
+        for (unsigned id = 0; id < N_IDS; id++)
+            n_cand += count1[id] != 0;
+        for (size_t p = 0; p < (size_t) N_IDS * N_IDS; p++)
+            n_cand += count2[p] != 0;
+
+        candidate_t *cand = malloc((n_cand + 1) * sizeof(candidate_t));
+        if (!cand) {
+            ok = false;
+            break;
+        }
+
+        size_t nc = 0;
+        for (unsigned a = 0; a < N_IDS; a++) {
+            uint8_t lit_a, lit_b;
+            unsigned len_a, len_b;
+            const uint8_t *sa;
+
+            if (!count1[a])
+                continue;
+            sa = id_bytes(t, a, &lit_a, &len_a);
+            memcpy(cand[nc].bytes, sa, len_a);
+            cand[nc].len = len_a;
+            cand[nc].gain = (uint64_t) count1[a] * len_a;
+            nc++;
+
+            for (unsigned b = 0; b < N_IDS; b++) {
+                uint32_t cnt = count2[a * N_IDS + b];
+                if (!cnt)
+                    continue;
+                const uint8_t *sb = id_bytes(t, b, &lit_b, &len_b);
+                if (len_a + len_b > FSST_SYMBOL_LEN)
+                    continue;
+                memcpy(cand[nc].bytes, sa, len_a);
+                memcpy(cand[nc].bytes + len_a, sb, len_b);
+                cand[nc].len = len_a + len_b;
+                cand[nc].gain = (uint64_t) cnt * (len_a + len_b);
+                nc++;
+            }
+        }
+
+        /* The same byte sequence may show up several times; merge them */
+        qsort(cand, nc, sizeof(candidate_t), cmp_bytes);
+        size_t merged = 0;
+        for (size_t i = 0; i < nc; i++) {
+            if (merged && !cmp_bytes(&cand[merged - 1], &cand[i]))
+                cand[merged - 1].gain += cand[i].gain;
+            else
+                cand[merged++] = cand[i];
+        }
+        qsort(cand, merged, sizeof(candidate_t), cmp_gain);
+
+        t->n_symbols = merged < FSST_MAX_SYMBOLS ? merged : FSST_MAX_SYMBOLS;
+        for (unsigned c = 0; c < t->n_symbols; c++) {
+            memset(t->symbol[c], 0, FSST_SYMBOL_LEN);
+            memcpy(t->symbol[c], cand[c].bytes, cand[c].len);
+            t->len[c] = cand[c].len;
+        }
+        build_index(t);
+        free(cand);
+    }
+
+    free(count1);
+    free(count2);
+    return ok;
+}
+
+size_t fsst_encode(const fsst_table_t *t, const char *s, uint8_t *out)
+{
+    const uint8_t *p = (const uint8_t *) s;
+    size_t n = strlen(s);
+    uint8_t *o = out;
+
+    while (n) {
+        unsigned code = find_symbol(t, p, n);
+        if (code == FSST_ESCAPE) {
+            *o++ = FSST_ESCAPE;
+            *o++ = *p++;
+            n--;
+        } else {
+            *o++ = code;
+            p += t->len[code];
+            n -= t->len[code];
+        }
+    }
+    return o - out;
+}
+
+size_t fsst_decode(const fsst_table_t *t,
+                   const uint8_t *in,
+                   size_t len,
+                   char *out)
+{
+    const uint8_t *end = in + len;
+    char *o = out;
+
+    while (in < end) {
+        unsigned code = *in++;
+        if (code != FSST_ESCAPE) {
+            /* Always copy a full symbol, then advance by its real length */
+            memcpy(o, t->symbol[code], FSST_SYMBOL_LEN);
+            o += t->len[code];
+        } else {
+            *o++ = *in++;
+        }
+    }
+    *o = '\0';
+    return o - out;
+}
@@ -0,0 +1,53 @@
+#ifndef LAB0_FSST_H
+#define LAB0_FSST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Lightweight string compression with a static symbol table, in the spirit of
+ * FSST (Fast Static Symbol Table).
+ *
+ * A table of up to 255 symbols, each 1 to 8 bytes long, is learned from a
+ * sample of strings. Encoding replaces the longest symbol matching at each
+ * position with a single-byte code. Bytes not covered by any symbol are
+ * emitted as the escape code followed by the literal byte.
+ */
+
+/* Number of usable codes; code 255 is reserved for escapes */
+#define FSST_MAX_SYMBOLS 255
+#define FSST_ESCAPE 255
+
+/* Maximum length of a symbol in bytes */
+#define FSST_SYMBOL_LEN 8
+
+typedef struct {
+    uint8_t symbol[FSST_MAX_SYMBOLS][FSST_SYMBOL_LEN];
+    uint8_t len[FSST_MAX_SYMBOLS];
+    unsigned n_symbols;
+    /* Codes grouped by their first byte, longest symbol first */
+    uint16_t first[257];
+    uint8_t by_first[FSST_MAX_SYMBOLS];
+} fsst_table_t;
+
+/* Learn a symbol table from n sample strings.
+ * Return false if scratch space could not be allocated.
+ */
+bool fsst_train(fsst_table_t *t, const char *const *samples, size_t n);
+
+/* Encode NUL-terminated string s into out, which must have room for
+ * 2 * strlen(s) bytes. Return the number of bytes written.
+ */
+size_t fsst_encode(const fsst_table_t *t, const char *s, uint8_t *out);
+
+/* Decode len bytes from in into out and NUL-terminate the result.
+ * out must have room for FSST_SYMBOL_LEN * len + 1 bytes, since every code
+ * is expanded with a single unaligned 8-byte store.
+ * Return the length of the decoded string.
+ */
+size_t fsst_decode(const fsst_table_t *t,
+                   const uint8_t *in,
+                   size_t len,
+                   char *out);
+
+#endif /* LAB0_FSST_H */
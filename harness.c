@@ -1,13 +1,30 @@
 /* Test support code */
 
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <execinfo.h>
+#define HAVE_BACKTRACE 1
+#endif
+#if defined(__GLIBC__)
+#include <malloc.h>
+#define HAVE_USABLE_SIZE 1
+#define malloc_usable(p) malloc_usable_size(p)
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#define HAVE_USABLE_SIZE 1
+#define malloc_usable(p) malloc_size(p)
+#endif
 
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -25,6 +42,9 @@
 /* Value at end of every block */
 #define MAGICFOOTER 0xbeefdead
 
+/* Value right after the payload of a compact block */
+#define MAGICCANARY 0xcafef00d
+
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
@@ -36,93 +56,1112 @@
 typedef struct __block_element {
     struct __block_element *next, *prev;
     size_t payload_size;
-    size_t magic_header; /* Marker to see if block seems legitimate */
+    uint32_t magic_header; /* Marker to see if block seems legitimate */
+    uint32_t heap;         /* Index of the list holding the block */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Allocation is thread-safe. Each thread links the blocks with a header it
+ * allocates into a list of its own, and counts the blocks it allocates and
+ * frees without locking, so that allocation_check() adds up the counts of
+ * all threads instead of every thread updating one shared counter. A block
+ * freed by another thread is unlinked from the list of the thread which
+ * allocated it, under the lock of that list.
+ *
+ * The tables shared by all threads are guarded by harness_lock, which is not
+ * held while calling malloc or filling payloads.
+ */
+#define HEAP_MAX 256
+
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock; /* Guards the list */
+    block_element_t *allocated;
+    atomic_size_t allocs, frees;
+} thread_heap_t;
+
+/* Heaps of the threads, the last one shared by threads beyond HEAP_MAX */
+static thread_heap_t heaps[HEAP_MAX] = {
+    [0 ... HEAP_MAX - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
+static atomic_size_t heap_count = 0;
+static _Thread_local thread_heap_t *this_heap = NULL;
+
+static pthread_mutex_t harness_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Data for managing exceptions */
+static jmp_buf env;
+static volatile sig_atomic_t jmp_ready = false;
+static bool time_limited = false;
+
+/* An exception raised by the time limit while the thread is inside the
+ * harness is held back until the outermost harness call returns, so that
+ * the jump leaves no lock held and no table half updated. Locks count as
+ * harness calls, for the functions which only take a lock.
+ */
+static _Thread_local volatile sig_atomic_t harness_depth = 0;
+static _Thread_local volatile sig_atomic_t exception_pending = false;
+
+static inline void enter(void)
+{
+    harness_depth++;
+}
+
+static inline void leave(void)
+{
+    if (!--harness_depth && exception_pending) {
+        exception_pending = false;
+        siglongjmp(env, 1);
+    }
+}
+
+static inline void lock(pthread_mutex_t *mutex)
+{
+    enter();
+    pthread_mutex_lock(mutex);
+}
+
+static inline void unlock(pthread_mutex_t *mutex)
+{
+    pthread_mutex_unlock(mutex);
+    leave();
+}
+
+/* Heap of the calling thread, claimed on its first allocation */
+static thread_heap_t *current_heap(void)
+{
+    if (!this_heap) {
+        size_t i = atomic_fetch_add(&heap_count, 1);
+        this_heap = &heaps[i < HEAP_MAX ? i : HEAP_MAX - 1];
+    }
+    return this_heap;
+}
+
+/* Count a block allocated or freed by the calling thread */
+static inline void count_alloc(void)
+{
+    atomic_fetch_add_explicit(&current_heap()->allocs, 1,
+                              memory_order_relaxed);
+}
+
+static inline void count_free(void)
+{
+    atomic_fetch_add_explicit(&current_heap()->frees, 1, memory_order_relaxed);
+}
+
+/* Add a block with a header to the list of the calling thread */
+static void link_block(block_element_t *b)
+{
+    thread_heap_t *heap = current_heap();
+    b->heap = heap - heaps;
+    b->prev = NULL;
+    lock(&heap->lock);
+    b->next = heap->allocated;
+    if (heap->allocated)
+        heap->allocated->prev = b;
+    heap->allocated = b;
+    unlock(&heap->lock);
+}
+
+/* Remove a block from the list of the thread which allocated it */
+static void unlink_block(block_element_t *b)
+{
+    thread_heap_t *heap = &heaps[b->heap];
+    lock(&heap->lock);
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        heap->allocated = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    unlock(&heap->lock);
+}
+
+/* Open-addressing table of the allocated blocks, so that cautious mode checks
+ * a block in constant time rather than by walking the list. It uses linear
+ * probing with backward shift deletion, and is kept at most half full.
+ *
+ * A block with a header is recorded by the address of its payload. A compact
+ * block has no header, and only a canary after its payload: it is recorded by
+ * the address of its payload tagged with LIVE_COMPACT, along with its size.
+ * Both hash alike, so that a free finds either kind with one probe sequence.
+ * A guarded block is recorded by the address of its header tagged with
+ * LIVE_GUARD. Every entry also tells where the block was allocated, for leak
+ * reports, and which tag it is charged to.
+ *
+ * The table starts with room for half a million blocks, so that it seldom
+ * grows. Its pages are zero-filled on demand, and only touched where blocks
+ * hash to.
+ */
+#define LIVE_INIT_SLOTS (1 << 20)
+#define LIVE_COMPACT 1
+#define LIVE_GUARD 2
+#define LIVE_TAGS (LIVE_COMPACT | LIVE_GUARD)
+
+typedef struct {
+    uintptr_t key;       /* Zero for an empty slot */
+    uint32_t size;       /* Payload size of a compact block */
+    uint32_t site : 10;  /* Index of the allocating line in fault_sites */
+    uint32_t stack : 12; /* Identifier of the recorded call stack, 0 if none */
+    uint32_t tag : 10;   /* Tag charged with the block */
+} live_entry_t;
+
+static live_entry_t *live_slot = NULL;
+static size_t live_nslots = 0, live_used = 0;
+
+/* Percent probability of malloc failure */
+int fail_probability = 0;
+
+/* Seed of the pseudo-random allocation failures */
+int fault_seed = 1;
+
+static bool cautious_mode = true;
+static bool noallocate_mode = false;
+static atomic_bool error_occurred = false;
+static char *error_message = "";
+
+int time_limit = 1;
+
+/* Serve small blocks from huge page arenas when nonzero */
+int arena_mode = 0;
+
+/* Allocate compact blocks, without header, when nonzero */
+int compact_mode = 0;
+
+/* For test_malloc and test_calloc */
+typedef enum {
+    TEST_MALLOC,
+    TEST_CALLOC,
+} alloc_t;
+
+/* Allocation arenas backed by transparent huge pages.
+ *
+ * In arena mode, blocks of up to ARENA_MAX_BLOCK bytes, header and footer
+ * included, are carved out of large anonymous mappings advised with
+ * MADV_HUGEPAGE, so that the nodes and strings of a long queue span few TLB
+ * entries. Freed blocks go to a free list per size class and are handed out
+ * again. The mappings are kept until exit, so that blocks allocated in arena
+ * mode can still be freed once the mode is turned off.
+ */
+#define ARENA_HUGE_PAGE ((size_t) 2 << 20)
+#define ARENA_REGION (32 * ARENA_HUGE_PAGE)
+#define ARENA_MAX_REGIONS 1024
+#define ARENA_ALIGN 16
+#define ARENA_MAX_BLOCK 1024
+
+typedef struct {
+    char *start, *end;
+} arena_region_t;
+
+/* Mapped regions, ordered by address */
+static arena_region_t arena_regions[ARENA_MAX_REGIONS];
+static size_t arena_nregions = 0;
+
+/* Unused part of the region being carved */
+static char *arena_next = NULL, *arena_limit = NULL;
+
+/* Freed blocks of each size class, linked through their next field */
+static block_element_t *arena_free[ARENA_MAX_BLOCK / ARENA_ALIGN + 1];
+
+/* Bytes in blocks currently allocated from the arenas */
+static size_t arena_used = 0;
+
+/* Whether the calling thread carves its blocks out of the unused part of the
+ * regions, one after the other, rather than reusing freed blocks
+ */
+static _Thread_local bool arena_carving = false;
+
+/* Guards the arenas. Regions are only ever added, so a block allocated
+ * before any region was mapped is known not to lie in one without locking.
+ */
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t arena_mapped = 0;
+
+/* Internal functions */
+
+/* Map a new region aligned on a huge page. Return false if out of memory */
+static bool arena_grow(void)
+{
+    if (arena_nregions == ARENA_MAX_REGIONS)
+        return false;
+
+    size_t len = ARENA_REGION + ARENA_HUGE_PAGE;
+    char *map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return false;
+
+    /* Trim the mapping to whole huge pages */
+    char *start = (char *) (((uintptr_t) map + ARENA_HUGE_PAGE - 1) &
+                            ~(ARENA_HUGE_PAGE - 1));
+    if (start > map)
+        munmap(map, start - map);
+    munmap(start + ARENA_REGION, map + len - (start + ARENA_REGION));
+#ifdef MADV_HUGEPAGE
+    madvise(start, ARENA_REGION, MADV_HUGEPAGE);
+#endif
+
+    size_t i = arena_nregions++;
+    while (i && arena_regions[i - 1].start > start) {
+        arena_regions[i] = arena_regions[i - 1];
+        i--;
+    }
+    arena_regions[i].start = start;
+    arena_regions[i].end = start + ARENA_REGION;
+    arena_next = start;
+    arena_limit = start + ARENA_REGION;
+    arena_mapped++;
+    return true;
+}
+
+/* Does the block lie in one of the arenas? */
+static bool arena_owns(const void *b)
+{
+    size_t lo = 0, hi = arena_nregions;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if ((const char *) b < arena_regions[mid].start)
+            hi = mid;
+        else if ((const char *) b >= arena_regions[mid].end)
+            lo = mid + 1;
+        else
+            return true;
+    }
+    return false;
+}
+
+static inline size_t arena_class(size_t bytes)
+{
+    return (bytes + ARENA_ALIGN - 1) / ARENA_ALIGN;
+}
+
+/* Get memory for a block of the given total size */
+static void *block_alloc(size_t bytes)
+{
+    if ((!arena_mode && !arena_carving) || bytes > ARENA_MAX_BLOCK)
+        return malloc(bytes);
+
+    size_t c = arena_class(bytes);
+    lock(&arena_lock);
+    block_element_t *b = arena_carving ? NULL : arena_free[c];
+    if (b) {
+        arena_free[c] = b->next;
+    } else {
+        size_t rounded = c * ARENA_ALIGN;
+        if ((size_t) (arena_limit - arena_next) < rounded && !arena_grow()) {
+            unlock(&arena_lock);
+            return malloc(bytes);
+        }
+        b = (block_element_t *) arena_next;
+        arena_next += rounded;
+    }
+    arena_used += c * ARENA_ALIGN;
+    unlock(&arena_lock);
+    return b;
+}
+
+/* Does the block lie in one of the arenas? */
+static bool arena_holds(const void *b)
+{
+    if (!arena_mapped)
+        return false;
+    lock(&arena_lock);
+    bool owned = arena_owns(b);
+    unlock(&arena_lock);
+    return owned;
+}
+
+/* Release the memory of a block of the given total size */
+static void block_free(void *p, size_t bytes)
+{
+    if (!arena_holds(p)) {
+        free(p);
+        return;
+    }
+
+    size_t c = arena_class(bytes);
+    block_element_t *b = p;
+    lock(&arena_lock);
+    b->next = arena_free[c];
+    arena_free[c] = b;
+    arena_used -= c * ARENA_ALIGN;
+    unlock(&arena_lock);
+}
+
+/* Can the memory of a block be resized in place to a new total size? An
+ * arena block can change size within its size class, and a block from malloc
+ * within the size malloc rounded it up to. Nothing is ever handed back to
+ * libc realloc, which would free a moved block behind the quarantine.
+ */
+static bool block_fits(void *p, size_t old_bytes, size_t bytes)
+{
+    if (arena_holds(p))
+        return arena_class(bytes) == arena_class(old_bytes);
+#ifdef HAVE_USABLE_SIZE
+    return bytes <= malloc_usable(p);
+#else
+    return bytes <= old_bytes;
+#endif
+}
+
+/* Blocks allocated one after the other go to nearby slots, so that walking a
+ * list to free it walks the table too, instead of missing the cache at each
+ * probe. Counting in 8-byte units keeps even a run of the smallest blocks
+ * down to one entry in four slots, so that runs from different mappings, or
+ * a run longer than the table wrapping onto itself, can share slots without
+ * forming long clusters. The high bits are folded in to keep distant mappings
+ * from lining up on the same slots.
+ */
+static inline size_t live_hash(uintptr_t key)
+{
+    size_t k = key >> 3;
+    return k ^ (k >> 20);
+}
+
+/* Find the entry of key, NULL if there is no such block */
+static live_entry_t *live_find(uintptr_t key)
+{
+    if (!live_nslots)
+        return NULL;
+
+    size_t mask = live_nslots - 1, i = live_hash(key) & mask;
+    while (live_slot[i].key) {
+        if (live_slot[i].key == key)
+            return &live_slot[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/* Find the entry of the block with a header or the compact block whose
+ * payload is p, NULL if there is none.
+ */
+static live_entry_t *live_lookup(const void *p)
+{
+    uintptr_t key = (uintptr_t) p;
+    if (!live_nslots || (key & LIVE_TAGS))
+        return NULL;
+
+    size_t mask = live_nslots - 1, i = live_hash(key) & mask;
+    while (live_slot[i].key) {
+        if ((live_slot[i].key & ~(uintptr_t) LIVE_COMPACT) == key)
+            return &live_slot[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/* Double the table. Return false if out of memory */
+static bool live_grow(void)
+{
+    size_t n = live_nslots ? live_nslots * 2 : LIVE_INIT_SLOTS;
+    live_entry_t *bigger = calloc(n, sizeof(live_entry_t));
+    if (!bigger)
+        return false;
+
+    for (size_t i = 0; i < live_nslots; i++) {
+        if (!live_slot[i].key)
+            continue;
+        size_t j = live_hash(live_slot[i].key) & (n - 1);
+        while (bigger[j].key)
+            j = (j + 1) & (n - 1);
+        bigger[j] = live_slot[i];
+    }
+    free(live_slot);
+    live_slot = bigger;
+    live_nslots = n;
+    return true;
+}
+
+/* Record a new block. Return false if out of memory */
+static bool live_add(live_entry_t entry)
+{
+    if ((live_used + 1) * 2 > live_nslots && !live_grow())
+        return false;
+
+    size_t mask = live_nslots - 1, i = live_hash(entry.key) & mask;
+    while (live_slot[i].key)
+        i = (i + 1) & mask;
+    live_slot[i] = entry;
+    live_used++;
+    return true;
+}
+
+/* Forward declarations */
+static void mem_charge(const live_entry_t *entry, size_t size);
+
+/* Record a new block of the given payload size, taking harness_lock. Return
+ * false if out of memory.
+ */
+static bool live_record(live_entry_t entry, size_t size)
+{
+    lock(&harness_lock);
+    bool ok = live_add(entry);
+    if (ok)
+        mem_charge(&entry, size);
+    unlock(&harness_lock);
+    return ok;
+}
+
+/* Forget the block in slot, moving back the entries probed past it */
+static void live_remove(live_entry_t *slot)
+{
+    size_t mask = live_nslots - 1, i = slot - live_slot, j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!live_slot[j].key)
+            break;
+        /* The entry at j can fill the hole at i unless its home slot lies
+         * cyclically in (i, j].
+         */
+        size_t k = live_hash(live_slot[j].key) & mask;
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            live_slot[i] = live_slot[j];
+            i = j;
+        }
+    }
+    live_slot[i].key = 0;
+    live_used--;
+}
+
+/* Fault injection.
+ *
+ * Each allocation site is identified by the "file:line" string passed by the
+ * malloc, calloc and strdup macros, and numbers its calls from 1 since the
+ * schedule was last set. Whether a call fails only depends on the schedule,
+ * the seed, the site and the call number, so a failing run replays exactly.
+ *
+ * Sites are kept in a fixed open-addressing table keyed by the address of
+ * their string. A site lookup is one hash and usually one probe, and a
+ * pseudo-random draw is one splitmix64 step, so tests with failures enabled
+ * run about as fast as tests without.
+ */
+#define FAULT_GOLDEN ((uintptr_t) 0x9e3779b97f4a7c15ULL)
+
+typedef struct {
+    const char *site; /* NULL for an empty slot */
+    uintptr_t hash;   /* Hash of the site string, stable across runs */
+    size_t calls, failures;
+    size_t generation; /* Schedule for which match was computed */
+    bool match;        /* Whether the schedule applies to this site */
+} fault_site_t;
+
+static fault_site_t fault_sites[FAULT_MAX_SITES];
+static size_t fault_nsites = 0;
+
+static fault_mode_t fault_mode = FAULT_NONE;
+static size_t fault_arg[FAULT_MAX_ARGS];
+static size_t fault_narg = 0;
+static char *fault_pattern = NULL;
+static size_t fault_generation = 1;
+
+/* Find the entry of a site, adding it if needed. The last slot is kept out
+ * of the probe range; when the rest of the table is full, the remaining sites
+ * share it.
+ */
+static fault_site_t *fault_site(const char *site)
+{
+    if (!site)
+        site = "(unknown)";
+
+    size_t nslots = FAULT_MAX_SITES - 1;
+    size_t i = (((uintptr_t) site * FAULT_GOLDEN) >> 23) % nslots;
+    for (size_t n = 0; n < nslots; n++, i = i + 1 < nslots ? i + 1 : 0) {
+        fault_site_t *s = &fault_sites[i];
+        if (s->site == site)
+            return s;
+        if (s->site)
+            continue;
+        if (fault_nsites == nslots)
+            break;
+        /* FNV-1a */
+        uintptr_t h = (uintptr_t) 0xcbf29ce484222325ULL;
+        for (const char *c = site; *c; c++)
+            h = (h ^ (unsigned char) *c) * (uintptr_t) 0x100000001b3ULL;
+        s->site = site;
+        s->hash = h;
+        fault_nsites++;
+        return s;
+    }
+
+    fault_site_t *other = &fault_sites[nslots];
+    if (!other->site)
+        other->site = "(other)";
+    return other;
+}
+
+/* Threshold below which a uniform draw falls with the given percent chance */
+static inline uintptr_t fault_threshold(size_t percent)
+{
+    return percent >= 100 ? UINTPTR_MAX : percent * (UINTPTR_MAX / 100);
+}
+
+/* Should a call at site s fail? Called with harness_lock held */
+static bool fault_check(fault_site_t *s)
+{
+    size_t n = ++s->calls;
+
+    if (fault_mode == FAULT_NONE && !fail_probability)
+        return false;
+
+    uintptr_t draw =
+        random_shuffle((s->hash ^ (uintptr_t) fault_seed) + n * FAULT_GOLDEN);
+    bool fail = fail_probability > 0 &&
+                draw < fault_threshold((size_t) fail_probability);
+
+    if (s->generation != fault_generation) {
+        s->match = !fault_pattern || strstr(s->site, fault_pattern);
+        s->generation = fault_generation;
+    }
+    if (s->match) {
+        switch (fault_mode) {
+        case FAULT_EVERY:
+            fail |= n % fault_arg[0] == 0;
+            break;
+        case FAULT_AT:
+            for (size_t i = 0; i < fault_narg; i++)
+                fail |= n == fault_arg[i];
+            break;
+        case FAULT_RANDOM:
+            /* Draw again so that both probabilities stay independent */
+            fail |= random_shuffle(draw) < fault_threshold(fault_arg[0]);
+            break;
+        default:
+            break;
+        }
+    }
+
+    s->failures += fail;
+    return fail;
+}
+
+/* Should this allocation fail? Store the index of its site in index */
+static bool fail_allocation(const char *site, uint16_t *index)
+{
+    lock(&harness_lock);
+    fault_site_t *s = fault_site(site);
+    bool fail = fault_check(s);
+    *index = s - fault_sites;
+    unlock(&harness_lock);
+    return fail;
+}
+
+/* Random sampling of about one event in n. The intervals between sampled
+ * events are drawn uniformly in [1, 2n - 1], so that no periodic pattern of
+ * events is always missed.
+ */
+typedef struct {
+    size_t countdown; /* Events left until the next sampled one */
+    uintptr_t rng;
+} sampler_t;
+
+/* Is this event sampled? Never if n is 0, always if n is 1 */
+static inline bool sample(sampler_t *sampler, int n)
+{
+    if (n <= 1)
+        return n == 1;
+    if (sampler->countdown > 1 && sampler->countdown <= 2 * (size_t) n) {
+        sampler->countdown--;
+        return false;
+    }
+
+    sampler->countdown =
+        1 + random_shuffle(++sampler->rng) % (2 * (size_t) n - 1);
+    return true;
+}
+
+/* Call stacks of allocations.
+ *
+ * With stack_sample set to n, the call stack of about one allocation in n is
+ * recorded, at random intervals so that no site hides behind a periodic
+ * allocation pattern, and every call stack is recorded if n is 1. Identical
+ * stacks are stored once, and a block only keeps the 16-bit identifier of its
+ * stack. A sampled allocation costs a backtrace() and a hash lookup.
+ */
+#define STACK_DEPTH 8
+#define STACK_MAX 4096
+
+/* Frames of stack_record() and alloc() left out of recorded stacks */
+#define STACK_SKIP 2
+
+typedef struct {
+    uintptr_t hash;
+    size_t depth;
+    void *frame[STACK_DEPTH];
+} stack_trace_t;
+
+int stack_sample = 1024;
+
+/* Recorded stacks, indexed by identifier from 1 */
+static stack_trace_t stack_traces[STACK_MAX];
+static size_t stack_count = 1;
+
+/* Identifiers of the recorded stacks, by hash with linear probing */
+static uint16_t stack_index[2 * STACK_MAX];
+
+static _Thread_local sampler_t stack_sampler;
+
+/* Record the stack of the caller of the harness. Return its identifier, or
+ * 0 if stacks cannot be obtained or the table of stacks is full.
+ */
+static __attribute__((noinline)) uint16_t stack_record(void)
+{
+#ifdef HAVE_BACKTRACE
+    void *frame[STACK_DEPTH + STACK_SKIP];
+    int n = backtrace(frame, STACK_DEPTH + STACK_SKIP) - STACK_SKIP;
+    if (n <= 0)
+        return 0;
+
+    void **caller = frame + STACK_SKIP;
+    uintptr_t h = n;
+    for (int k = 0; k < n; k++)
+        h = random_shuffle(h ^ (uintptr_t) caller[k]);
+
+    uint16_t id = 0;
+    size_t mask = 2 * STACK_MAX - 1, i = h & mask;
+    lock(&harness_lock);
+    for (; stack_index[i]; i = (i + 1) & mask) {
+        stack_trace_t *t = &stack_traces[stack_index[i]];
+        if (t->hash == h && t->depth == (size_t) n &&
+            !memcmp(t->frame, caller, n * sizeof(void *))) {
+            id = stack_index[i];
+            break;
+        }
+    }
+    if (!id && stack_count < STACK_MAX) {
+        stack_trace_t *t = &stack_traces[stack_count];
+        t->hash = h;
+        t->depth = n;
+        memcpy(t->frame, caller, n * sizeof(void *));
+        stack_index[i] = id = stack_count++;
+    }
+    unlock(&harness_lock);
+    return id;
+#else
+    return 0;
+#endif
+}
+
+/* Record the call stack if this allocation is sampled */
+static inline uint16_t stack_sampled(void)
+{
+    return sample(&stack_sampler, stack_sample) ? stack_record() : 0;
+}
+
+/* Poisoning of payloads.
+ *
+ * With poison_sample set to n, the payload of about one block in n is filled
+ * with FILLCHAR when it is allocated, and again when it is freed, so that
+ * code reading uninitialized or freed memory misbehaves visibly. Every block
+ * is poisoned if n is 1, and none if n is 0, leaving only the header, footer
+ * or canary checks. Sampling saves the memory bandwidth of the fills on large
+ * values and long queues.
+ */
+int poison_sample = 1;
+
+static _Thread_local sampler_t poison_sampler;
+
+/* Fill a new payload: zeroed for calloc, poisoned for malloc if sampled */
+static inline void fill_new(alloc_t alloc_type, void *p, size_t size)
+{
+    if (alloc_type == TEST_CALLOC)
+        memset(p, 0, size);
+    else if (sample(&poison_sampler, poison_sample))
+        memset(p, FILLCHAR, size);
+}
+
+/* Poison a freed payload if sampled. Return the number of bytes poisoned */
+static inline size_t fill_freed(void *p, size_t size)
+{
+    if (!sample(&poison_sampler, poison_sample))
+        return 0;
+    memset(p, FILLCHAR, size);
+    return size;
+}
+
+/* Quarantine of freed blocks.
+ *
+ * With quarantine_size set to n, the memory of the last n freed blocks is
+ * held in a ring instead of being released, so that it is not handed out
+ * again while dangling pointers to it may still be used. A double free of a
+ * block in quarantine is reported like any other, and when a block leaves
+ * the ring, its payload is checked to still be poisoned if it was.
+ */
+#define QUARANTINE_MAX (1 << 20)
+
+typedef struct {
+    void *block;  /* Memory to release, NULL for an empty entry */
+    size_t bytes; /* Total size of the memory, for block_free() */
+    unsigned char *payload;
+    size_t poisoned; /* Bytes of the payload filled with FILLCHAR */
+} quarantine_entry_t;
+
+int quarantine_size = 0;
+
+static quarantine_entry_t *quarantine = NULL;
+static atomic_size_t quarantine_cap = 0;
+static size_t quarantine_next = 0;
+static pthread_mutex_t quarantine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void quarantine_release(quarantine_entry_t *q)
+{
+    if (!q->block)
+        return;
+
+    /* All bytes equal to the first one, which is FILLCHAR */
+    unsigned char *p = q->payload;
+    size_t n = q->poisoned;
+    if (n && (p[0] != FILLCHAR || memcmp(p, p + 1, n - 1))) {
+        report_event(MSG_ERROR,
+                     "Block with address %p was modified after being freed",
+                     p);
+        error_occurred = true;
+    }
+    block_free(q->block, q->bytes);
+    q->block = NULL;
+}
+
+/* Release the memory of a freed block, through the quarantine if enabled */
+static void release(void *block,
+                    size_t bytes,
+                    unsigned char *payload,
+                    size_t poisoned)
+{
+    size_t cap = quarantine_size <= 0 ? 0 : (size_t) quarantine_size;
+    if (!cap && !quarantine_cap) {
+        block_free(block, bytes);
+        return;
+    }
+    if (cap > QUARANTINE_MAX)
+        cap = QUARANTINE_MAX;
+
+    lock(&quarantine_lock);
+    if (cap != quarantine_cap) {
+        for (size_t i = 0; i < quarantine_cap; i++)
+            quarantine_release(&quarantine[i]);
+        free(quarantine);
+        quarantine = cap ? calloc(cap, sizeof(quarantine_entry_t)) : NULL;
+        quarantine_cap = quarantine ? cap : 0;
+        quarantine_next = 0;
+    }
+
+    if (!quarantine_cap) {
+        unlock(&quarantine_lock);
+        block_free(block, bytes);
+        return;
+    }
+
+    quarantine_entry_t *q = &quarantine[quarantine_next];
+    quarantine_release(q);
+    q->block = block;
+    q->bytes = bytes;
+    q->payload = payload;
+    q->poisoned = poisoned;
+    quarantine_next = (quarantine_next + 1) % quarantine_cap;
+    unlock(&quarantine_lock);
+}
+
+/* Find header of block, given its payload and its entry in the table, NULL
+ * if it has none. Signal error if doesn't seem like legitimate block, and
+ * return NULL if cautious mode shows it is not allocated at all. Called with
+ * harness_lock held.
+ */
+static block_element_t *find_header(void *p, const live_entry_t *entry)
+{
+    if (!p) {
+        report_event(MSG_ERROR, "Attempting to free null block");
+        error_occurred = true;
+    }
+
+    block_element_t *b =
+        (block_element_t *) ((size_t) p - sizeof(block_element_t));
+    if (cautious_mode && !entry) {
+        /* Not an allocated block */
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated block.  Address = %p", p);
+        error_occurred = true;
+        return NULL;
+    }
+
+    if (b->magic_header != MAGICHEADER) {
+        report_event(
+            MSG_ERROR,
+            "Attempted to free unallocated or corrupted block.  Address = %p",
+            p);
+        error_occurred = true;
+    }
+
+    return b;
+}
+
+/* Given pointer to block, find its footer */
+static size_t *find_footer(block_element_t *b)
+{
+    // cppcheck-suppress nullPointerRedundantCheck
+    size_t *p =
+        (size_t *) ((size_t) b + b->payload_size + sizeof(block_element_t));
+    return p;
+}
+
+/* Allocate a block described only by its entry in the table of blocks */
+static void *alloc_compact(alloc_t alloc_type, size_t size, live_entry_t meta)
+{
+    unsigned char *p = block_alloc(size + sizeof(uint32_t));
+    if (!p) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+        return NULL;
+    }
+
+    uint32_t canary = MAGICCANARY;
+    memcpy(p + size, &canary, sizeof(canary));
+    meta.key = (uintptr_t) p | LIVE_COMPACT;
+    meta.size = size;
+    if (!live_record(meta, size)) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+        block_free(p, size + sizeof(uint32_t));
+        return NULL;
+    }
+    fill_new(alloc_type, p, size);
+    count_alloc();
+    return p;
+}
+
+/* Release a compact block of the given size, once out of the table */
+static void free_compact(unsigned char *p, size_t size)
+{
+    uint32_t canary;
+    memcpy(&canary, p + size, sizeof(canary));
+    if (canary != MAGICCANARY) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to free it",
+                     p);
+        error_occurred = true;
+    }
+    size_t poisoned = fill_freed(p, size);
+    release(p, size + sizeof(uint32_t), p, poisoned);
+    count_free();
+}
+
+/* Guarded blocks.
+ *
+ * When guard_size is nonzero, a block of at least guard_size bytes gets a
+ * mapping of its own, followed by an inaccessible guard page. The header is
+ * at the start of the mapping and the payload ends right against the guard
+ * page, so that the first access past its end faults at once, without any
+ * check on each access. Since the size of a type is a multiple of its
+ * alignment, the payload is still aligned for the type it holds.
+ *
+ * A guarded block takes at least two pages and two mappings, which suits
+ * large blocks or short tests. When mmap fails, a normal block is allocated.
+ */
+int guard_size = 0;
+
+static atomic_size_t guard_count = 0;
+
+static inline size_t page_size(void)
+{
+    static size_t page = 0;
+    if (!page)
+        page = sysconf(_SC_PAGESIZE);
+    return page;
+}
+
+/* Length of the mapping of a guarded block, guard page excluded */
+static inline size_t guard_span(size_t size)
+{
+    size_t page = page_size();
+    return (sizeof(block_element_t) + size + page - 1) & ~(page - 1);
+}
+
+/* Key of the guarded block which would hold payload p */
+static inline uintptr_t guard_key(const void *p)
+{
+    uintptr_t b = (uintptr_t) p - sizeof(block_element_t);
+    return (b & ~(page_size() - 1)) | LIVE_GUARD;
+}
+
+static inline block_element_t *guard_header(const live_entry_t *entry)
+{
+    return (block_element_t *) (entry->key & ~LIVE_TAGS);
+}
+
+static inline unsigned char *guard_payload(const block_element_t *b)
+{
+    return (unsigned char *) b + guard_span(b->payload_size) - b->payload_size;
+}
+
+/* Allocate a guarded block. Return NULL if it could not be mapped */
+static void *alloc_guarded(alloc_t alloc_type, size_t size, live_entry_t meta)
+{
+    size_t span = guard_span(size);
+    char *map = mmap(NULL, span + page_size(), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    block_element_t *b = (block_element_t *) map;
+    b->magic_header = MAGICHEADER;
+    b->payload_size = size;
+    meta.key = (uintptr_t) map | LIVE_GUARD;
+    if (mprotect(map + span, page_size(), PROT_NONE) ||
+        !live_record(meta, size)) {
+        munmap(map, span + page_size());
+        return NULL;
+    }
+    link_block(b);
+    count_alloc();
+    guard_count++;
+
+    unsigned char *p = guard_payload(b);
+    fill_new(alloc_type, p, size);
+    return p;
+}
+
+/* Release a guarded block, once out of the table */
+static void free_guarded(unsigned char *p, block_element_t *b)
+{
+    if (b->magic_header != MAGICHEADER) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to free it",
+                     p);
+        error_occurred = true;
+    }
+
+    unlink_block(b);
+    munmap(b, guard_span(b->payload_size) + page_size());
+    count_free();
+    guard_count--;
+}
+
+/* Find the entry of the guarded block holding p, NULL if there is none.
+ * Called with harness_lock held.
+ */
+static inline live_entry_t *guard_find(const void *p)
+{
+    return guard_count ? live_find(guard_key(p)) : NULL;
+}
+
+/* Payload size of the block of a live entry. Called with harness_lock held */
+static size_t live_payload_size(const live_entry_t *e)
+{
+    if (e->key & LIVE_COMPACT)
+        return e->size;
+    if (e->key & LIVE_GUARD)
+        return guard_header(e)->payload_size;
+    return ((block_element_t *) (e->key - sizeof(block_element_t)))
+        ->payload_size;
+}
+
+/* Memory accounting by tag and by size class.
+ *
+ * The counters are updated under harness_lock along with the table of
+ * blocks, so that accounting takes no lock of its own. The overhead of a
+ * block is what the harness adds to its payload: header and footer, canary,
+ * or the rest of the pages of a guarded block. Rounding by malloc or by the
+ * arenas is not counted.
+ */
+typedef struct {
+    mem_stat_t stat;
+    bool held; /* Claimed by mem_tag_new() and not released since */
+} mem_tag_t;
 
-/* Percent probability of malloc failure */
-int fail_probability = 0;
+static mem_tag_t mem_tags[MEM_TAGS];
+static unsigned mem_next_tag = 1;
+static _Thread_local unsigned this_tag = 0;
 
-static bool cautious_mode = true;
-static bool noallocate_mode = false;
-static bool error_occurred = false;
-static char *error_message = "";
+static mem_class_t mem_class[MEM_CLASSES];
 
-static int time_limit = 1;
+static inline mem_class_t *mem_class_of(size_t size)
+{
+    return &mem_class[size ? 8 * sizeof(size_t) - __builtin_clzl(size) : 0];
+}
 
-/* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+static size_t mem_overhead(uintptr_t key, size_t size)
+{
+    if (key & LIVE_COMPACT)
+        return sizeof(uint32_t);
+    if (key & LIVE_GUARD)
+        return guard_span(size) + page_size() - size;
+    return sizeof(block_element_t) + sizeof(size_t);
+}
 
-/* For test_malloc and test_calloc */
-typedef enum {
-    TEST_MALLOC,
-    TEST_CALLOC,
-} alloc_t;
+/* Charge a new block to its tag. Called with harness_lock held */
+static void mem_charge(const live_entry_t *entry, size_t size)
+{
+    mem_stat_t *s = &mem_tags[entry->tag].stat;
+    s->bytes += size;
+    if (s->bytes > s->peak)
+        s->peak = s->bytes;
+    s->overhead += mem_overhead(entry->key, size);
+    s->blocks++;
+    s->allocs++;
 
-/* Internal functions */
+    mem_class_t *c = mem_class_of(size);
+    c->bytes += size;
+    if (c->bytes > c->peak)
+        c->peak = c->bytes;
+    c->blocks++;
+    c->allocs++;
+}
 
-/* Should this allocation fail? */
-static bool fail_allocation()
+/* Take a block off its tag. Called with harness_lock held */
+static void mem_discharge(const live_entry_t *entry, size_t size)
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    mem_stat_t *s = &mem_tags[entry->tag].stat;
+    s->bytes -= size;
+    s->overhead -= mem_overhead(entry->key, size);
+    s->blocks--;
+
+    mem_class_t *c = mem_class_of(size);
+    c->bytes -= size;
+    c->blocks--;
+    c->frees++;
 }
 
-/* Find header of block, given its payload.
- * Signal error if doesn't seem like legitimate block
- */
-static block_element_t *find_header(void *p)
+/* Allocate a block of the kind selected by the current modes */
+static void *alloc_block(alloc_t alloc_type, size_t size, live_entry_t meta)
 {
-    if (!p) {
-        report_event(MSG_ERROR, "Attempting to free null block");
-        error_occurred = true;
+    if (guard_size > 0 && size >= (size_t) guard_size) {
+        void *p = alloc_guarded(alloc_type, size, meta);
+        if (p)
+            return p;
     }
 
-    block_element_t *b =
-        (block_element_t *) ((size_t) p - sizeof(block_element_t));
-    if (cautious_mode) {
-        /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
-            report_event(MSG_ERROR,
-                         "Attempted to free unallocated block.  Address = %p",
-                         p);
-            error_occurred = true;
-        }
-    }
+    if (compact_mode && size <= UINT32_MAX)
+        return alloc_compact(alloc_type, size, meta);
 
-    if (b->magic_header != MAGICHEADER) {
-        report_event(
-            MSG_ERROR,
-            "Attempted to free unallocated or corrupted block.  Address = %p",
-            p);
+    block_element_t *new_block =
+        block_alloc(size + sizeof(block_element_t) + sizeof(size_t));
+    if (!new_block) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
     }
 
-    return b;
-}
-
-/* Given pointer to block, find its footer */
-static size_t *find_footer(block_element_t *b)
-{
     // cppcheck-suppress nullPointerRedundantCheck
-    size_t *p =
-        (size_t *) ((size_t) b + b->payload_size + sizeof(block_element_t));
+    new_block->magic_header = MAGICHEADER;
+    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->payload_size = size;
+    *find_footer(new_block) = MAGICFOOTER;
+    meta.key = (uintptr_t) &new_block->payload;
+    if (!live_record(meta, size)) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+    }
+    void *p = (void *) &new_block->payload;
+    fill_new(alloc_type, p, size);
+    link_block(new_block);
+    count_alloc();
+
     return p;
 }
 
-static void *alloc(alloc_t alloc_type, size_t size)
+/* Not inlined, so that recorded stacks start at a known depth */
+static __attribute__((noinline)) void *alloc(alloc_t alloc_type,
+                                             size_t size,
+                                             const char *site)
 {
     if (noallocate_mode) {
         char *msg_alloc_forbidden[] = {
@@ -133,7 +1172,8 @@ static void *alloc(alloc_t alloc_type, size_t size)
         return NULL;
     }
 
-    if (fail_allocation()) {
+    uint16_t index;
+    if (fail_allocation(site, &index)) {
         char *msg_alloc_failure[] = {
             "Malloc returning NULL",
             "Calloc returning NULL",
@@ -142,52 +1182,58 @@ static void *alloc(alloc_t alloc_type, size_t size)
         return NULL;
     }
 
-    block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
-    if (!new_block) {
-        report_event(MSG_FATAL, "Couldn't allocate any more memory");
-        error_occurred = true;
-    }
+    live_entry_t meta = {
+        .site = index,
+        .stack = stack_sampled(),
+        .tag = this_tag,
+    };
+    return alloc_block(alloc_type, size, meta);
+}
 
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->magic_header = MAGICHEADER;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
-    void *p = (void *) &new_block->payload;
-    memset(p, !alloc_type * FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
+/* Implementation of application functions */
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+void *test_malloc(size_t size)
+{
+    return test_malloc_at(size, NULL);
+}
 
+/* Leave a call returning block p. The caller never gets p if an exception
+ * is pending, so release it before the jump.
+ */
+static void *leave_alloc(void *p)
+{
+    if (harness_depth == 1 && exception_pending && p) {
+        harness_depth--;
+        test_free(p);
+    }
+    leave();
     return p;
 }
 
-/* Implementation of application functions */
-
-void *test_malloc(size_t size)
+void *test_malloc_at(size_t size, const char *site)
 {
-    return alloc(TEST_MALLOC, size);
+    enter();
+    return leave_alloc(alloc(TEST_MALLOC, size, site));
 }
 
 // cppcheck-suppress unusedFunction
 void *test_calloc(size_t nelem, size_t elsize)
+{
+    return test_calloc_at(nelem, elsize, NULL);
+}
+
+void *test_calloc_at(size_t nelem, size_t elsize, const char *site)
 {
     /* Reference: Malloc tutorial
      * https://danluu.com/malloc-tutorial/
      */
     if (!nelem || !elsize || nelem > SIZE_MAX / elsize)
         return NULL;
-    return alloc(TEST_CALLOC, nelem * elsize);
+    enter();
+    return leave_alloc(alloc(TEST_CALLOC, nelem * elsize, site));
 }
 
-void test_free(void *p)
+static void release_block(void *p)
 {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to free disallowed");
@@ -197,7 +1243,50 @@ void test_free(void *p)
     if (!p)
         return;
 
-    block_element_t *b = find_header(p);
+    /* Take the block out of the table first, so that a concurrent free of
+     * the same block finds it missing.
+     */
+    lock(&harness_lock);
+
+    /* A compact block is only known by its entry in the table */
+    live_entry_t *entry = live_lookup(p);
+    if (entry && (entry->key & LIVE_COMPACT)) {
+        size_t size = entry->size;
+        mem_discharge(entry, size);
+        live_remove(entry);
+        unlock(&harness_lock);
+        free_compact(p, size);
+        return;
+    }
+
+    if (!entry && (entry = guard_find(p))) {
+        block_element_t *b = guard_header(entry);
+        bool found = p == guard_payload(b);
+        if (found) {
+            mem_discharge(entry, b->payload_size);
+            live_remove(entry);
+        }
+        unlock(&harness_lock);
+        if (found) {
+            free_guarded(p, b);
+        } else {
+            report_event(MSG_ERROR,
+                         "Attempted to free unallocated block.  Address = %p",
+                         p);
+            error_occurred = true;
+        }
+        return;
+    }
+
+    block_element_t *b = find_header(p, entry);
+    if (b && entry) {
+        mem_discharge(entry, b->payload_size);
+        live_remove(entry);
+    }
+    unlock(&harness_lock);
+    if (!b)
+        return;
+
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
         report_event(MSG_ERROR,
@@ -208,40 +1297,480 @@ void test_free(void *p)
     }
     b->magic_header = MAGICFREE;
     *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
+    size_t poisoned = fill_freed(p, b->payload_size);
+    unlink_block(b);
 
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
+    release(b, b->payload_size + sizeof(block_element_t) + sizeof(size_t), p,
+            poisoned);
+    count_free();
+}
+
+void test_free(void *p)
+{
+    enter();
+    release_block(p);
+    leave();
+}
+
+// cppcheck-suppress unusedFunction
+void *test_realloc(void *p, size_t size)
+{
+    return test_realloc_at(p, size, NULL);
+}
+
+/* Move a block to a new one of the kind selected by the current modes, and
+ * free the old one like any other, poisoned and quarantined if enabled.
+ * Called with no lock held.
+ */
+static void *realloc_move(void *p,
+                          size_t old_size,
+                          size_t size,
+                          live_entry_t meta)
+{
+    void *q = alloc_block(TEST_MALLOC, size, meta);
+    if (!q)
+        return NULL;
+    memcpy(q, p, old_size < size ? old_size : size);
+    test_free(p);
+    return q;
+}
+
+/* Resize a compact block in place or move it. Called with harness_lock
+ * held, which it releases.
+ */
+static void *realloc_compact(unsigned char *p, size_t size, live_entry_t *slot)
+{
+    size_t old_size = slot->size;
+    live_entry_t meta = *slot;
+    if (size > UINT32_MAX ||
+        !block_fits(p, old_size + sizeof(uint32_t), size + sizeof(uint32_t))) {
+        unlock(&harness_lock);
+        return realloc_move(p, old_size, size, meta);
+    }
+
+    uint32_t canary;
+    memcpy(&canary, p + old_size, sizeof(canary));
+    if (canary != MAGICCANARY) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to reallocate it",
+                     p);
+        error_occurred = true;
+    }
+
+    canary = MAGICCANARY;
+    memcpy(p + size, &canary, sizeof(canary));
+    mem_discharge(slot, old_size);
+    meta.size = size;
+    *slot = meta;
+    mem_charge(&meta, size);
+    unlock(&harness_lock);
+
+    if (size > old_size)
+        fill_new(TEST_MALLOC, p + old_size, size - old_size);
+    return p;
+}
+
+static void *realloc_block(void *p, size_t size, const char *site)
+{
+    if (!p)
+        return test_malloc_at(size, site);
+    if (!size) {
+        test_free(p);
+        return NULL;
+    }
+
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to realloc are disallowed");
+        return NULL;
+    }
+
+    uint16_t index;
+    if (fail_allocation(site, &index)) {
+        report_event(MSG_WARN, "Realloc returning NULL");
+        return NULL;
+    }
+
+    lock(&harness_lock);
+
+    live_entry_t *entry = live_lookup(p);
+    if (entry && (entry->key & LIVE_COMPACT))
+        return realloc_compact(p, size, entry);
+
+    if (!entry && (entry = guard_find(p))) {
+        /* The payload of a guarded block has to end against its guard page,
+         * so the block moves.
+         */
+        live_entry_t meta = *entry;
+        size_t old_size = guard_header(entry)->payload_size;
+        unlock(&harness_lock);
+        return realloc_move(p, old_size, size, meta);
+    }
+
+    block_element_t *b = find_header(p, entry);
+    if (!b) {
+        unlock(&harness_lock);
+        return NULL;
+    }
+
+    size_t old_size = b->payload_size;
+    if (!block_fits(b, old_size + sizeof(block_element_t) + sizeof(size_t),
+                    size + sizeof(block_element_t) + sizeof(size_t))) {
+        live_entry_t meta = {0};
+        if (entry)
+            meta = *entry;
+        unlock(&harness_lock);
+        return realloc_move(p, old_size, size, meta);
+    }
+
+    if (*find_footer(b) != MAGICFOOTER) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to reallocate it",
+                     p);
+        error_occurred = true;
+    }
+
+    /* The block stays where it is, linked in the list of its heap */
+    if (entry) {
+        mem_discharge(entry, old_size);
+        mem_charge(entry, size);
+    }
+    b->payload_size = size;
+    *find_footer(b) = MAGICFOOTER;
+    unlock(&harness_lock);
+
+    if (size > old_size)
+        fill_new(TEST_MALLOC, b->payload + old_size, size - old_size);
+    return b->payload;
+}
 
-    free(b);
-    allocated_count--;
+void *test_realloc_at(void *p, size_t size, const char *site)
+{
+    enter();
+    return leave_alloc(realloc_block(p, size, site));
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
+{
+    return test_strdup_at(s, NULL);
+}
+
+char *test_strdup_at(const char *s, const char *site)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
-    if (!new)
-        return NULL;
+    enter();
+    void *new = test_malloc_at(len, site);
+    if (new)
+        memcpy(new, s, len);
+    return leave_alloc(new);
+}
+
+bool fault_schedule(fault_mode_t mode,
+                    const size_t *arg,
+                    size_t narg,
+                    const char *site)
+{
+    switch (mode) {
+    case FAULT_NONE:
+        break;
+    case FAULT_EVERY:
+        if (narg != 1 || !arg[0])
+            return false;
+        break;
+    case FAULT_AT:
+        if (!narg || narg > FAULT_MAX_ARGS)
+            return false;
+        break;
+    case FAULT_RANDOM:
+        if (narg != 1 || arg[0] > 100)
+            return false;
+        break;
+    default:
+        return false;
+    }
+
+    char *pattern = NULL;
+    if (site && !(pattern = strdup(site)))
+        return false;
+
+    lock(&harness_lock);
+    free(fault_pattern);
+    fault_pattern = pattern;
+    fault_mode = mode;
+    fault_narg = narg;
+    if (narg)
+        memcpy(fault_arg, arg, narg * sizeof(size_t));
+    fault_generation++;
+    for (size_t i = 0; i < FAULT_MAX_SITES; i++)
+        fault_sites[i].calls = fault_sites[i].failures = 0;
+    unlock(&harness_lock);
+    return true;
+}
+
+size_t fault_stats(fault_stat_t *stat, size_t max)
+{
+    size_t n = 0;
+    lock(&harness_lock);
+    for (size_t i = 0; i < FAULT_MAX_SITES && n < max; i++) {
+        if (!fault_sites[i].site)
+            continue;
+        stat[n].site = fault_sites[i].site;
+        stat[n].calls = fault_sites[i].calls;
+        stat[n].failures = fault_sites[i].failures;
+        n++;
+    }
+    unlock(&harness_lock);
+    return n;
+}
+
+/* Order blocks by site and stack, then groups by decreasing size */
+static int leak_key_cmp(const void *a, const void *b)
+{
+    const leak_stat_t *la = a, *lb = b;
+    if (la->site != lb->site)
+        return la->site < lb->site ? -1 : 1;
+    return (int) la->stack - (int) lb->stack;
+}
+
+static int leak_bytes_cmp(const void *a, const void *b)
+{
+    const leak_stat_t *la = a, *lb = b;
+    if (la->bytes != lb->bytes)
+        return la->bytes < lb->bytes ? 1 : -1;
+    return leak_key_cmp(a, b);
+}
+
+size_t leak_stats(leak_stat_t *stat, size_t max)
+{
+    lock(&harness_lock);
+    leak_stat_t *group =
+        live_used ? malloc(live_used * sizeof(leak_stat_t)) : NULL;
+    if (!group) {
+        unlock(&harness_lock);
+        return 0;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < live_nslots; i++) {
+        live_entry_t *e = &live_slot[i];
+        if (!e->key)
+            continue;
+        group[n].site = fault_sites[e->site].site;
+        group[n].stack = e->stack;
+        group[n].blocks = 1;
+        group[n].bytes = live_payload_size(e);
+        n++;
+    }
+    unlock(&harness_lock);
+    qsort(group, n, sizeof(leak_stat_t), leak_key_cmp);
+
+    size_t ngroups = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (ngroups && !leak_key_cmp(&group[ngroups - 1], &group[i])) {
+            group[ngroups - 1].blocks++;
+            group[ngroups - 1].bytes += group[i].bytes;
+        } else {
+            group[ngroups++] = group[i];
+        }
+    }
+    qsort(group, ngroups, sizeof(leak_stat_t), leak_bytes_cmp);
+
+    if (ngroups > max)
+        ngroups = max;
+    memcpy(stat, group, ngroups * sizeof(leak_stat_t));
+    free(group);
+    return ngroups;
+}
+
+/* Called from the signal handler, so the table is read without locking */
+void *guard_block(const void *addr, size_t *size, const char **site)
+{
+    for (size_t i = 0; guard_count && i < live_nslots; i++) {
+        if (!(live_slot[i].key & LIVE_GUARD))
+            continue;
+        block_element_t *b = guard_header(&live_slot[i]);
+        unsigned char *p = guard_payload(b);
+        unsigned char *end = p + b->payload_size;
+        if ((const unsigned char *) addr >= end &&
+            (const unsigned char *) addr < end + page_size()) {
+            *size = b->payload_size;
+            *site = fault_sites[live_slot[i].site].site;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+char **stack_symbols(unsigned stack, size_t *depth)
+{
+#ifdef HAVE_BACKTRACE
+    void *frame[STACK_DEPTH];
+    lock(&harness_lock);
+    bool known = stack && stack < stack_count;
+    if (known) {
+        *depth = stack_traces[stack].depth;
+        memcpy(frame, stack_traces[stack].frame, *depth * sizeof(void *));
+    }
+    unlock(&harness_lock);
+    return known ? backtrace_symbols(frame, *depth) : NULL;
+#else
+    (void) stack;
+    (void) depth;
+    return NULL;
+#endif
+}
+
+unsigned mem_tag_new(void)
+{
+    unsigned tag = 0;
+    lock(&harness_lock);
+    for (unsigned n = 1; n < MEM_TAGS && !tag; n++) {
+        unsigned t = mem_next_tag;
+        mem_next_tag = t % (MEM_TAGS - 1) + 1;
+        if (mem_tags[t].held || mem_tags[t].stat.blocks)
+            continue;
+        memset(&mem_tags[t].stat, 0, sizeof(mem_stat_t));
+        mem_tags[t].held = true;
+        tag = t;
+    }
+    unlock(&harness_lock);
+    return tag;
+}
+
+void mem_tag_release(unsigned tag)
+{
+    if (!tag || tag >= MEM_TAGS)
+        return;
+    lock(&harness_lock);
+    mem_tags[tag].held = false;
+    unlock(&harness_lock);
+}
+
+void mem_tag_set(unsigned tag)
+{
+    this_tag = tag < MEM_TAGS ? tag : 0;
+}
+
+void mem_tag_move(unsigned from, unsigned to)
+{
+    if (from == to || from >= MEM_TAGS || to >= MEM_TAGS)
+        return;
+
+    lock(&harness_lock);
+    for (size_t i = 0; i < live_nslots; i++) {
+        if (live_slot[i].key && live_slot[i].tag == from)
+            live_slot[i].tag = to;
+    }
+    mem_stat_t *f = &mem_tags[from].stat, *t = &mem_tags[to].stat;
+    t->bytes += f->bytes;
+    if (t->bytes > t->peak)
+        t->peak = t->bytes;
+    t->overhead += f->overhead;
+    t->blocks += f->blocks;
+    f->bytes = f->overhead = f->blocks = 0;
+    unlock(&harness_lock);
+}
+
+void mem_block_move(const void *p, unsigned to)
+{
+    if (!p || to >= MEM_TAGS)
+        return;
 
-    return memcpy(new, s, len);
+    lock(&harness_lock);
+    live_entry_t *entry = live_lookup(p);
+    if (!entry)
+        entry = guard_find(p);
+    if (entry && entry->tag != to) {
+        size_t size = live_payload_size(entry);
+        size_t overhead = mem_overhead(entry->key, size);
+        mem_stat_t *f = &mem_tags[entry->tag].stat, *t = &mem_tags[to].stat;
+        f->bytes -= size;
+        f->overhead -= overhead;
+        f->blocks--;
+        t->bytes += size;
+        if (t->bytes > t->peak)
+            t->peak = t->bytes;
+        t->overhead += overhead;
+        t->blocks++;
+        entry->tag = to;
+    }
+    unlock(&harness_lock);
+}
+
+void mem_stats(unsigned tag, mem_stat_t *stat)
+{
+    lock(&harness_lock);
+    *stat = mem_tags[tag < MEM_TAGS ? tag : 0].stat;
+    unlock(&harness_lock);
+}
+
+void mem_classes(mem_class_t *stat)
+{
+    lock(&harness_lock);
+    memcpy(stat, mem_class, sizeof(mem_class));
+    unlock(&harness_lock);
 }
 
 size_t allocation_check()
 {
-    return allocated_count;
+    /* Frees by other threads can make the count of a single thread negative,
+     * but the total is exact once no thread allocates or frees.
+     */
+    size_t n = 0, nheaps = heap_count < HEAP_MAX ? heap_count : HEAP_MAX;
+    for (size_t i = 0; i < nheaps; i++)
+        n += heaps[i].allocs - heaps[i].frees;
+    return n;
 }
 
 /* Implementation of functions for testing */
 
+bool arena_carve(bool on)
+{
+    bool was = arena_carving;
+    arena_carving = on;
+    return was;
+}
+
+/* Report arena usage, reading residency from /proc/self/smaps */
+bool arena_usage(size_t *mapped, size_t *used, size_t *rss, size_t *huge)
+{
+    arena_region_t regions[ARENA_MAX_REGIONS];
+    lock(&arena_lock);
+    size_t nregions = arena_nregions;
+    memcpy(regions, arena_regions, nregions * sizeof(arena_region_t));
+    *used = arena_used;
+    unlock(&arena_lock);
+    *mapped = nregions * ARENA_REGION;
+    *rss = *huge = 0;
+
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    if (!smaps)
+        return false;
+
+    /* Add up the counters of the mappings overlapping an arena */
+    char line[256];
+    bool inside = false;
+    while (fgets(line, sizeof(line), smaps)) {
+        unsigned long lo, hi;
+        size_t kb;
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+            inside = false;
+            for (size_t i = 0; i < nregions && !inside; i++) {
+                inside = lo < (uintptr_t) regions[i].end &&
+                         hi > (uintptr_t) regions[i].start;
+            }
+        } else if (inside && sscanf(line, "Rss: %zu kB", &kb) == 1) {
+            *rss += kb << 10;
+        } else if (inside && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+            *huge += kb << 10;
+        }
+    }
+    fclose(smaps);
+    return true;
+}
+
 /* Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
@@ -261,9 +1790,7 @@ void set_noallocate_mode(bool noallocate)
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    return atomic_exchange(&error_occurred, false);
 }
 
 /* Prepare for a risky operation using setjmp.
@@ -274,6 +1801,7 @@ bool exception_setup(bool limit_time)
     if (sigsetjmp(env, 1)) {
         /* Got here from longjmp */
         jmp_ready = false;
+        exception_pending = false;
         if (time_limited) {
             alarm(0);
             time_limited = false;
@@ -311,8 +1839,10 @@ void trigger_exception(char *msg)
 {
     error_occurred = true;
     error_message = msg;
-    if (jmp_ready)
-        siglongjmp(env, 1);
-    else
+    if (!jmp_ready)
         exit(1);
+    if (harness_depth)
+        exception_pending = true;
+    else
+        siglongjmp(env, 1);
 }
@@ -8,13 +8,26 @@
 /* This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
  * allow checking for common allocation errors.
+ *
+ * The allocation functions may be called from any thread. Exceptions and the
+ * time limit only apply to the thread running the test.
  */
 
 void *test_malloc(size_t size);
 void *test_calloc(size_t nmemb, size_t size);
 void test_free(void *p);
 char *test_strdup(const char *s);
-/* FIXME: provide test_realloc as well */
+
+/* Resize a block, in place when the memory after it allows. On failure,
+ * return NULL and leave the block as it was.
+ */
+void *test_realloc(void *p, size_t size);
+
+/* Same as above, site naming the calling source line for fault injection */
+void *test_malloc_at(size_t size, const char *site);
+void *test_calloc_at(size_t nmemb, size_t size, const char *site);
+char *test_strdup_at(const char *s, const char *site);
+void *test_realloc_at(void *p, size_t size, const char *site);
 
 #ifdef INTERNAL
 
@@ -24,6 +37,181 @@ size_t allocation_check();
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Seed of the pseudo-random allocation failures */
+extern int fault_seed;
+
+/*
+ * Scheduled allocation failures. Calls are numbered from 1 at each call site,
+ * counting from the time the schedule was set, and a call fails if the
+ * schedule or fail_probability says so.
+ */
+typedef enum {
+    FAULT_NONE,   /* Only fail_probability applies */
+    FAULT_EVERY,  /* Fail the calls whose number is a multiple of arg[0] */
+    FAULT_AT,     /* Fail the calls numbered arg[0], arg[1], ... */
+    FAULT_RANDOM, /* Fail each call with a probability of arg[0] percent */
+} fault_mode_t;
+
+#define FAULT_MAX_ARGS 16
+#define FAULT_MAX_SITES 512
+
+/*
+ * Schedule allocation failures at the call sites whose "file:line" contains
+ * site, or at all sites if site is NULL, and restart the call numbering.
+ * Return false if the schedule is not valid.
+ */
+bool fault_schedule(fault_mode_t mode,
+                    const size_t *arg,
+                    size_t narg,
+                    const char *site);
+
+typedef struct {
+    const char *site;
+    size_t calls, failures;
+} fault_stat_t;
+
+/*
+ * Copy the number of calls and of failures since the schedule was set for up
+ * to max call sites into stat. Return the number of sites copied.
+ */
+size_t fault_stats(fault_stat_t *stat, size_t max);
+
+/*
+ * Record the call stack of one allocation in stack_sample on average, of
+ * every allocation if 1, and of none if 0.
+ */
+extern int stack_sample;
+
+/*
+ * Fill the payload of one block in poison_sample on average with a pattern
+ * when allocated and freed, every payload if 1, and none if 0.
+ */
+extern int poison_sample;
+
+/*
+ * Hold the memory of the last quarantine_size freed blocks before reusing it,
+ * and check on release that poisoned payloads were not written to.
+ */
+extern int quarantine_size;
+
+/*
+ * Place blocks of at least guard_size bytes right before an inaccessible
+ * page, so that overflows fault at once, when nonzero.
+ */
+extern int guard_size;
+
+/*
+ * Find the guarded block whose guard page holds addr. Return its payload, and
+ * store its size and allocating line, or return NULL if addr is in no guard
+ * page. It does not allocate, so a signal handler can call it.
+ */
+void *guard_block(const void *addr, size_t *size, const char **site);
+
+typedef struct {
+    const char *site; /* Allocating source line */
+    unsigned stack;   /* Recorded call stack, 0 if not sampled */
+    size_t blocks, bytes;
+} leak_stat_t;
+
+/*
+ * Group the allocated blocks by allocating line and call stack, and copy up
+ * to max groups into stat, largest first. Blocks whose stack was not sampled
+ * are grouped by line only. Return the number of groups copied.
+ */
+size_t leak_stats(leak_stat_t *stat, size_t max);
+
+/*
+ * Describe the frames of a recorded call stack, innermost first, and store
+ * their number in depth. Return an array to release with free(), or NULL if
+ * the stack is not known.
+ */
+char **stack_symbols(unsigned stack, size_t *depth);
+
+/*
+ * Memory accounting by owner. A thread sets the tag charged with the blocks
+ * it allocates, and each block stays charged to its tag until it is freed,
+ * whichever thread frees it. Tag 0 is charged when no tag is set.
+ */
+#define MEM_TAGS 1024
+
+typedef struct {
+    size_t bytes;    /* Payload bytes of the live blocks */
+    size_t peak;     /* Largest value reached by bytes */
+    size_t overhead; /* Bytes the harness adds to the live blocks */
+    size_t blocks;   /* Live blocks */
+    size_t allocs;   /* Blocks allocated or resized so far */
+} mem_stat_t;
+
+/*
+ * Claim a tag with cleared counters, which no owner holds and no live block
+ * is charged to. Return 0 if there is none left.
+ */
+unsigned mem_tag_new(void);
+
+/* Give up a tag. Blocks still charged to it keep it until they are freed */
+void mem_tag_release(unsigned tag);
+
+/* Charge the blocks the calling thread allocates to tag */
+void mem_tag_set(unsigned tag);
+
+/* Charge the live blocks of tag from to tag to instead */
+void mem_tag_move(unsigned from, unsigned to);
+
+/*
+ * Charge the live block at p to tag to, wherever it was charged before.
+ * Blocks the harness does not know are ignored.
+ */
+void mem_block_move(const void *p, unsigned to);
+
+/* Copy the counters of tag into stat */
+void mem_stats(unsigned tag, mem_stat_t *stat);
+
+/*
+ * Blocks by power-of-two size class. Class 0 holds empty payloads, and class
+ * k > 0 payloads of 2^(k-1) to 2^k - 1 bytes. A resized block counts as freed
+ * from its old class and allocated in its new one.
+ */
+#define MEM_CLASSES (8 * sizeof(size_t) + 1)
+
+typedef struct {
+    size_t blocks; /* Live blocks */
+    size_t bytes;  /* Payload bytes of the live blocks */
+    size_t peak;   /* Largest value reached by bytes */
+    size_t allocs; /* Blocks allocated so far */
+    size_t frees;  /* Blocks freed so far */
+} mem_class_t;
+
+/* Copy the counters of the MEM_CLASSES size classes into stat */
+void mem_classes(mem_class_t *stat);
+
+/* Seconds a timed operation may run before it is aborted */
+extern int time_limit;
+
+/* Serve small blocks from huge page arenas instead of malloc when nonzero */
+extern int arena_mode;
+
+/*
+ * Allocate compact blocks when nonzero. Instead of a header and a footer, a
+ * compact block only has a 4-byte canary after its payload, and its size is
+ * kept in the table of allocated blocks. Overflows are still detected, but
+ * not writes before the start of the payload.
+ */
+extern int compact_mode;
+
+/*
+ * Carve the small blocks the calling thread allocates out of the arenas one
+ * after the other when on is true, even if arena mode is off, instead of
+ * reusing freed blocks. Return the previous setting.
+ */
+bool arena_carve(bool on);
+
+/*
+ * Report the bytes mapped for arenas, the bytes of blocks allocated from
+ * them, and how many bytes of the arenas are resident and how many of those
+ * are backed by huge pages. Return false if residency could not be read.
+ */
+bool arena_usage(size_t *mapped, size_t *used, size_t *rss, size_t *huge);
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -53,14 +241,21 @@ void trigger_exception(char *msg);
 
 #else /* !INTERNAL */
 
-/* Tested program use our versions of malloc and free */
-#define malloc test_malloc
-#define calloc test_calloc
+#define HARNESS_STR(x) #x
+#define HARNESS_XSTR(x) HARNESS_STR(x)
+#define HARNESS_SITE __FILE__ ":" HARNESS_XSTR(__LINE__)
+
+/* Tested program use our versions of malloc and free, which are told where
+ * they are called from.
+ */
+#define malloc(size) test_malloc_at(size, HARNESS_SITE)
+#define calloc(nmemb, size) test_calloc_at(nmemb, size, HARNESS_SITE)
+#define realloc(p, size) test_realloc_at(p, size, HARNESS_SITE)
 #define free test_free
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
-#define strdup test_strdup
+#define strdup(s) test_strdup_at(s, HARNESS_SITE)
 
 #endif
 
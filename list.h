@@ -7,6 +7,7 @@ extern "C" {
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
 
 /* "typeof" is a GNU extension.
  * Reference: https://gcc.gnu.org/onlinedocs/gcc/Typeof.html
@@ -428,6 +429,272 @@ static inline void list_move_tail(struct list_head *node,
          &entry->member != (head); entry = safe,                           \
         safe = list_entry(safe->member.next, __typeof__(*entry), member))
 
+/**
+ * LIST_PREFETCH_DISTANCE - Number of nodes prefetched ahead of a traversal
+ *
+ * The *_prefetch iterators keep a second cursor this many nodes ahead of the
+ * current one, and prefetch the node after it. Walking the list is then
+ * overlapped with the work done on each node. 0 disables prefetching.
+ */
+#ifndef LIST_PREFETCH_DISTANCE
+#define LIST_PREFETCH_DISTANCE 8
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define list_prefetch(addr) __builtin_prefetch(addr)
+#else
+#define list_prefetch(addr) ((void) (addr))
+#endif
+
+#if LIST_PREFETCH_DISTANCE > 0
+/**
+ * list_prefetch_start() - Place a prefetch cursor ahead of a list node
+ * @node: first node of the traversal, or @head
+ * @head: pointer to the head of the list
+ *
+ * Return: the node LIST_PREFETCH_DISTANCE nodes after @node, or @head if the
+ * list ends before
+ */
+static inline struct list_head *list_prefetch_start(struct list_head *node,
+                                                    struct list_head *head)
+{
+    for (int i = 0; i < LIST_PREFETCH_DISTANCE && node != head; i++) {
+        node = node->next;
+        list_prefetch(node->next);
+    }
+    return node;
+}
+
+/**
+ * list_prefetch_next() - Advance a prefetch cursor by one node
+ * @ahead: prefetch cursor
+ * @head: pointer to the head of the list
+ *
+ * The node following the new position is prefetched, so that it is cached by
+ * the time the cursor reaches it. The cursor stays at @head once there.
+ *
+ * Return: the new position of the cursor
+ */
+static inline struct list_head *list_prefetch_next(struct list_head *ahead,
+                                                   struct list_head *head)
+{
+    if (ahead == head)
+        return ahead;
+    ahead = ahead->next;
+    list_prefetch(ahead->next);
+    return ahead;
+}
+#else
+/* Without prefetching, the cursor sits at @head and is never moved */
+static inline struct list_head *list_prefetch_start(struct list_head *node,
+                                                    struct list_head *head)
+{
+    (void) node;
+    return head;
+}
+
+static inline struct list_head *list_prefetch_next(struct list_head *ahead,
+                                                   struct list_head *head)
+{
+    (void) head;
+    return ahead;
+}
+#endif
+
+/**
+ * list_for_each_prefetch - Iterate over list nodes, prefetching ahead
+ * @node: list_head pointer used as iterator
+ * @ahead: list_head pointer used as prefetch cursor
+ * @head: pointer to the head of the list
+ *
+ * Same as list_for_each, for long lists whose nodes are not in cache.
+ */
+#define list_for_each_prefetch(node, ahead, head)                      \
+    for (node = (head)->next, ahead = list_prefetch_start(node, head); \
+         node != (head);                                               \
+         node = node->next, ahead = list_prefetch_next(ahead, head))
+
+/**
+ * list_prefetch_field - Prefetch the target of a pointer in the entry at a
+ * prefetch cursor
+ * @ahead: prefetch cursor
+ * @head: pointer to the head of the list
+ * @type: type of the entries
+ * @member: name of the list_head member variable in struct @type
+ * @field: name of a pointer member variable in struct @type
+ */
+#if LIST_PREFETCH_DISTANCE > 0
+#define list_prefetch_field(ahead, head, type, member, field)                  \
+    ((ahead) != (head) ? list_prefetch(list_entry(ahead, type, member)->field) \
+                       : (void) 0)
+#else
+#define list_prefetch_field(ahead, head, type, member, field) ((void) 0)
+#endif
+
+#ifdef __LIST_HAVE_TYPEOF
+/**
+ * list_for_each_entry_prefetch - Iterate over list entries, prefetching ahead
+ * @entry: pointer used as iterator
+ * @ahead: list_head pointer used as prefetch cursor
+ * @head: pointer to the head of the list
+ * @member: name of the list_head member variable in struct type of @entry
+ * @field: name of a pointer member of @entry whose target is prefetched too,
+ *         such as a string the body reads
+ *
+ * Same as list_for_each_entry, for long lists whose nodes are not in cache.
+ */
+#define list_for_each_entry_prefetch(entry, ahead, head, member, field)        \
+    for (entry = list_entry((head)->next, __typeof__(*entry), member),         \
+        ahead = list_prefetch_start((head)->next, head);                       \
+         &entry->member != (head);                                             \
+         entry = list_entry(entry->member.next, __typeof__(*entry), member),   \
+        ahead = list_prefetch_next(ahead, head),                               \
+        list_prefetch_field(ahead, head, __typeof__(*entry), member, field))
+
+/**
+ * list_for_each_entry_safe_prefetch - Iterate over list entries, prefetching
+ * ahead and allowing deletes
+ * @entry: pointer used as iterator
+ * @safe: @type pointer used to store info for next entry in list
+ * @ahead: list_head pointer used as prefetch cursor
+ * @head: pointer to the head of the list
+ * @member: name of the list_head member variable in struct type of @entry
+ * @field: name of a pointer member of @entry whose target is prefetched too
+ *
+ * Same as list_for_each_entry_safe. Only the current node may be removed, and
+ * the prefetch cursor is always past it.
+ */
+#define list_for_each_entry_safe_prefetch(entry, safe, ahead, head, member, \
+                                          field)                            \
+    for (entry = list_entry((head)->next, __typeof__(*entry), member),      \
+        safe = list_entry(entry->member.next, __typeof__(*entry), member),  \
+        ahead = list_prefetch_start(entry->member.next, head);              \
+         &entry->member != (head); entry = safe,                            \
+        safe = list_entry(safe->member.next, __typeof__(*entry), member),   \
+        ahead = list_prefetch_next(ahead, head),                            \
+        list_prefetch_field(ahead, head, __typeof__(*entry), member, field))
+#endif
+
+/**
+ * list_cmp_func_t - Comparison function of list_sort()
+ * @priv: private data, passed unmodified from list_sort()
+ * @a: first node to compare
+ * @b: second node to compare
+ *
+ * Return: a value greater than zero if @a must come after @b, and a value less
+ * than or equal to zero otherwise. Equal nodes keep their relative order.
+ */
+typedef int (*list_cmp_func_t)(void *priv,
+                               const struct list_head *a,
+                               const struct list_head *b);
+
+/**
+ * __list_sort_merge() - Merge two sorted NULL-terminated lists linked by next
+ * @priv: private data for @cmp
+ * @cmp: comparison function
+ * @a: first list, whose nodes win ties
+ * @b: second list
+ *
+ * The node to take is selected through a pointer to @a or @b, so the loop has
+ * a single data-dependent branch: the comparison. When a list runs out, the
+ * other one is appended as is.
+ *
+ * Return: the merged list, linked by next only
+ */
+static inline struct list_head *__list_sort_merge(void *priv,
+                                                  list_cmp_func_t cmp,
+                                                  struct list_head *a,
+                                                  struct list_head *b)
+{
+    struct list_head *head = NULL, **tail = &head;
+
+    for (;;) {
+        struct list_head **node = cmp(priv, a, b) <= 0 ? &a : &b;
+        *tail = *node;
+        tail = &(*node)->next;
+        *node = (*node)->next;
+        if (!*node)
+            break;
+    }
+    *tail = (struct list_head *) ((uintptr_t) a | (uintptr_t) b);
+    return head;
+}
+
+/**
+ * list_sort() - Sort a list
+ * @priv: private data, passed unmodified to @cmp
+ * @head: pointer to the head of the list
+ * @cmp: comparison function
+ *
+ * This is a stable bottom-up merge sort, after the one of the Linux kernel.
+ * It allocates nothing and uses constant stack space.
+ *
+ * Sorted sublists waiting to be merged are kept in a stack threaded through
+ * their prev pointers, while next links the nodes of each sublist. Every
+ * sublist has a power-of-two size. After adding the count-th node, the bits of
+ * count tell which merge to do: two pending sublists of size 2^k are merged
+ * when the lowest clear bit of count is bit k and a higher bit is set. A merge
+ * is thus done only once the node count guarantees a 2:1 balance at worst, and
+ * the merges which remain at the end are balanced as well.
+ */
+static inline void list_sort(void *priv,
+                             struct list_head *head,
+                             list_cmp_func_t cmp)
+{
+    struct list_head *list = head->next, *pending = NULL;
+    size_t count = 0;
+
+    /* Zero or one node */
+    if (list == head->prev)
+        return;
+
+    head->prev->next = NULL;
+
+    do {
+        size_t bits;
+        struct list_head **tail = &pending;
+
+        /* Find the least-significant clear bit in count */
+        for (bits = count; bits & 1; bits >>= 1)
+            tail = &(*tail)->prev;
+        /* Merge the two sublists below it, unless count is 2^k - 1 */
+        if (bits) {
+            struct list_head *a = *tail, *b = a->prev;
+
+            a = __list_sort_merge(priv, cmp, b, a);
+            a->prev = b->prev;
+            *tail = a;
+        }
+
+        /* Move one node from the input to a new pending sublist */
+        list->prev = pending;
+        pending = list;
+        list = list->next;
+        pending->next = NULL;
+        count++;
+    } while (list);
+
+    /* Merge all pending sublists, most recent first */
+    list = pending;
+    pending = pending->prev;
+    for (;;) {
+        struct list_head *next = pending->prev;
+
+        if (!next)
+            break;
+        list = __list_sort_merge(priv, cmp, pending, list);
+        pending = next;
+    }
+    list = __list_sort_merge(priv, cmp, pending, list);
+
+    /* Restore the prev links and the circular structure */
+    struct list_head *prev = head;
+    for (head->next = list; list; prev = list, list = list->next)
+        list->prev = prev;
+    prev->next = head;
+    head->prev = prev;
+}
+
 #undef __LIST_HAVE_TYPEOF
 
 #ifdef __cplusplus
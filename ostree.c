@@ -0,0 +1,236 @@
+/* Order-statistics tree implemented as an implicit treap */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ostree.h"
+#include "random.h"
+
+typedef struct ost_node {
+    struct ost_node *left, *right;
+    struct list_head *item;
+    size_t size;   /* Number of nodes in this subtree */
+    uint32_t prio; /* Heap priority, larger values closer to the root */
+    uint32_t rev;  /* Children still have to be swapped and reversed */
+} ost_node_t;
+
+struct ostree {
+    ost_node_t *root;
+    uintptr_t seed;
+};
+
+static inline size_t node_size(const ost_node_t *n)
+{
+    return n ? n->size : 0;
+}
+
+static inline void update(ost_node_t *n)
+{
+    n->size = 1 + node_size(n->left) + node_size(n->right);
+}
+
+/* Apply a pending reversal to the children of n */
+static inline void push(ost_node_t *n)
+{
+    if (!n->rev)
+        return;
+    ost_node_t *tmp = n->left;
+    n->left = n->right;
+    n->right = tmp;
+    if (n->left)
+        n->left->rev ^= 1;
+    if (n->right)
+        n->right->rev ^= 1;
+    n->rev = 0;
+}
+
+/* Split n into its first k nodes and the rest */
+static void split(ost_node_t *n, size_t k, ost_node_t **l, ost_node_t **r)
+{
+    if (!n) {
+        *l = *r = NULL;
+        return;
+    }
+    push(n);
+    if (node_size(n->left) < k) {
+        split(n->right, k - node_size(n->left) - 1, &n->right, r);
+        *l = n;
+    } else {
+        split(n->left, k, l, &n->left);
+        *r = n;
+    }
+    update(n);
+}
+
+/* Concatenate two trees, all nodes of l coming first */
+static ost_node_t *merge(ost_node_t *l, ost_node_t *r)
+{
+    if (!l || !r)
+        return l ? l : r;
+    if (l->prio > r->prio) {
+        push(l);
+        l->right = merge(l->right, r);
+        update(l);
+        return l;
+    }
+    push(r);
+    r->left = merge(l, r->left);
+    update(r);
+    return r;
+}
+
+static void free_nodes(ost_node_t *n)
+{
+    if (!n)
+        return;
+    free_nodes(n->left);
+    free_nodes(n->right);
+    free(n);
+}
+
+static ost_node_t *new_node(ostree_t *t, struct list_head *item)
+{
+    ost_node_t *n = malloc(sizeof(ost_node_t));
+    if (!n)
+        return NULL;
+    t->seed = random_shuffle(t->seed);
+    n->left = n->right = NULL;
+    n->item = item;
+    n->size = 1;
+    n->prio = (uint32_t) t->seed;
+    n->rev = 0;
+    return n;
+}
+
+/* Fix subtree sizes after a bottom-up build */
+static size_t fix_sizes(ost_node_t *n)
+{
+    if (!n)
+        return 0;
+    n->size = 1 + fix_sizes(n->left) + fix_sizes(n->right);
+    return n->size;
+}
+
+ostree_t *ost_new(void)
+{
+    ostree_t *t = malloc(sizeof(ostree_t));
+    if (!t)
+        return NULL;
+    t->root = NULL;
+    t->seed = (uintptr_t) t;
+    return t;
+}
+
+void ost_free(ostree_t *t)
+{
+    if (!t)
+        return;
+    free_nodes(t->root);
+    free(t);
+}
+
+bool ost_build(ostree_t *t, struct list_head *head)
+{
+    free_nodes(t->root);
+    t->root = NULL;
+
+    size_t n = 0, depth = 0;
+    struct list_head *node;
+    list_for_each (node, head)
+        n++;
+    if (!n)
+        return true;
+
+    /* Build the Cartesian tree of the priorities in linear time, keeping the
+     * right spine of the tree on a stack.
+     */
+    ost_node_t **spine = malloc(n * sizeof(ost_node_t *));
+    if (!spine)
+        return false;
+
+    list_for_each (node, head) {
+        ost_node_t *cur = new_node(t, node);
+        if (!cur) {
+            if (depth)
+                free_nodes(spine[0]);
+            free(spine);
+            return false;
+        }
+        ost_node_t *last = NULL;
+        while (depth && spine[depth - 1]->prio < cur->prio)
+            last = spine[--depth];
+        cur->left = last;
+        if (depth)
+            spine[depth - 1]->right = cur;
+        spine[depth++] = cur;
+    }
+    t->root = spine[0];
+    free(spine);
+    fix_sizes(t->root);
+    return true;
+}
+
+size_t ost_size(const ostree_t *t)
+{
+    return node_size(t->root);
+}
+
+bool ost_insert(ostree_t *t, size_t pos, struct list_head *node)
+{
+    ost_node_t *n = new_node(t, node);
+    if (!n)
+        return false;
+
+    ost_node_t *l, *r;
+    split(t->root, pos, &l, &r);
+    t->root = merge(merge(l, n), r);
+    return true;
+}
+
+struct list_head *ost_remove(ostree_t *t, size_t pos)
+{
+    if (pos >= ost_size(t))
+        return NULL;
+
+    ost_node_t *l, *mid, *r;
+    split(t->root, pos, &l, &r);
+    split(r, 1, &mid, &r);
+    t->root = merge(l, r);
+
+    struct list_head *item = mid->item;
+    free(mid);
+    return item;
+}
+
+struct list_head *ost_at(ostree_t *t, size_t pos)
+{
+    ost_node_t *n = t->root;
+    if (pos >= ost_size(t))
+        return NULL;
+
+    for (;;) {
+        push(n);
+        size_t left = node_size(n->left);
+        if (pos == left)
+            return n->item;
+        if (pos < left) {
+            n = n->left;
+        } else {
+            pos -= left + 1;
+            n = n->right;
+        }
+    }
+}
+
+void ost_reverse(ostree_t *t, size_t pos, size_t len)
+{
+    if (len < 2)
+        return;
+
+    ost_node_t *l, *mid, *r;
+    split(t->root, pos, &l, &r);
+    split(r, len, &mid, &r);
+    if (mid)
+        mid->rev ^= 1;
+    t->root = merge(merge(l, mid), r);
+}
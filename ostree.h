@@ -0,0 +1,51 @@
+#ifndef LAB0_OSTREE_H
+#define LAB0_OSTREE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "list.h"
+
+/* Order-statistics tree over the nodes of a queue.
+ *
+ * The tree is a treap keyed implicitly by position: every tree node counts
+ * the list nodes in its subtree, so the i-th node of the queue is reached in
+ * O(log n) expected time. A range can be reversed in O(log n) by flagging
+ * its subtree, and the flag is pushed down lazily. This only covers the tree:
+ * reversing the same range of the list still relinks each of its nodes.
+ *
+ * The tree only records the order of list nodes it was given. Whoever
+ * changes the list must apply the same change to the tree.
+ */
+
+typedef struct ostree ostree_t;
+
+/* Create an empty tree. Return NULL if allocation failed */
+ostree_t *ost_new(void);
+
+/* Release the tree. The list nodes it refers to are not touched */
+void ost_free(ostree_t *t);
+
+/* Replace the content of the tree with the nodes of list head, in order.
+ * Return false if allocation failed, in which case the tree is left empty.
+ */
+bool ost_build(ostree_t *t, struct list_head *head);
+
+/* Number of list nodes recorded in the tree */
+size_t ost_size(const ostree_t *t);
+
+/* Record node at position pos, 0 <= pos <= ost_size(t).
+ * Return false if allocation failed.
+ */
+bool ost_insert(ostree_t *t, size_t pos, struct list_head *node);
+
+/* Forget the node at position pos and return it, NULL if pos is past the end */
+struct list_head *ost_remove(ostree_t *t, size_t pos);
+
+/* Return the node at position pos, NULL if pos is past the end */
+struct list_head *ost_at(ostree_t *t, size_t pos);
+
+/* Reverse the order of len nodes starting at position pos */
+void ost_reverse(ostree_t *t, size_t pos, size_t len);
+
+#endif /* LAB0_OSTREE_H */
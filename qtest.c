@@ -1,8 +1,10 @@
 /* Implementation of testing code for queue code */
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -19,9 +21,13 @@
 #include <time.h>
 #endif
 
+#include "bloom.h"
 #include "dudect/fixture.h"
+#include "fsst.h"
 #include "list.h"
+#include "ostree.h"
 #include "random.h"
+#include "tqueue.h"
 
 /* Shannon entropy */
 extern double shannon_entropy(const uint8_t *input_data);
@@ -53,7 +59,6 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -69,12 +74,21 @@ static queue_contex_t *current = NULL;
 
 /* How many times can queue operations fail */
 static int fail_limit = BIG_LIST_SIZE;
-static int fail_count = 0;
+static size_t fail_count = 0;
 
 static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+/* Order used by sort: 0 for strcmp, 1 for natural order, 2 to ignore case,
+ * 3 for length first. Orders other than strcmp go through q_sort_by().
+ */
+static int sort_key = 0;
+#define SORT_KEYS 4
+
+/* Serve dm from the order-statistics tree, and keep it through reverseK */
+static int use_ostree = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -86,6 +100,134 @@ typedef enum {
 /* Forward declarations */
 static bool q_show(int vlevel);
 
+/* Nodes may have been removed, so the search index can no longer be trusted,
+ * but the remaining nodes keep their relative order.
+ */
+static void queue_drop_index(queue_contex_t *ctx)
+{
+    if (ctx)
+        q_index_free(&ctx->index);
+}
+
+/* Nodes may have moved or been removed without the order-statistics tree
+ * being told about it.
+ */
+static void queue_drop_tree(queue_contex_t *ctx)
+{
+    if (ctx) {
+        ost_free(ctx->tree);
+        ctx->tree = NULL;
+    }
+}
+
+/* Values were removed or moved to another queue without the Bloom filter
+ * being told about it.
+ */
+static void queue_drop_filter(queue_contex_t *ctx)
+{
+    if (ctx) {
+        bloom_free(ctx->filter);
+        ctx->filter = NULL;
+    }
+}
+
+/* Nodes were inserted at positions unrelated to their values */
+static void queue_unsorted(queue_contex_t *ctx)
+{
+    if (ctx) {
+        ctx->sorted = 0;
+        queue_drop_index(ctx);
+    }
+}
+
+/* Nodes were rearranged by an operation the tree does not follow */
+static void queue_reordered(queue_contex_t *ctx)
+{
+    queue_unsorted(ctx);
+    queue_drop_tree(ctx);
+}
+
+/* The queue was just verified to be sorted in the given direction */
+static void queue_sorted(queue_contex_t *ctx, bool descend)
+{
+    if (ctx) {
+        ctx->sorted = descend ? -1 : 1;
+        queue_drop_index(ctx);
+        queue_drop_tree(ctx);
+    }
+}
+
+/* Build the Bloom filter of a queue on first use, or once it outgrew it */
+static bool queue_filter(queue_contex_t *ctx)
+{
+    if (ctx->filter && bloom_capacity(ctx->filter) >= ctx->size)
+        return true;
+
+    queue_drop_filter(ctx);
+    ctx->filter = bloom_new(ctx->size);
+    if (!ctx->filter)
+        return false;
+
+    element_t *item;
+    struct list_head *ahead;
+    list_for_each_entry_prefetch (item, ahead, ctx->q, list, value)
+        bloom_add(ctx->filter, item->value);
+    return true;
+}
+
+/* Build the order-statistics tree of a queue on first use */
+static bool queue_tree(queue_contex_t *ctx)
+{
+    if (ctx->tree && ost_size(ctx->tree) == ctx->size)
+        return true;
+
+    queue_drop_tree(ctx);
+    ctx->tree = ost_new();
+    if (ctx->tree && ost_build(ctx->tree, ctx->q))
+        return true;
+    queue_drop_tree(ctx);
+    return false;
+}
+
+/* Make ctx the current queue, charged with the memory allocated from now on */
+static void queue_select(queue_contex_t *ctx)
+{
+    current = ctx;
+    mem_tag_set(ctx ? ctx->tag : 0);
+}
+
+/* Charge the elements of ctx and their values to ctx, once moved into it */
+static void queue_retag(queue_contex_t *ctx)
+{
+    element_t *item;
+    list_for_each_entry (item, ctx->q, list) {
+        mem_block_move(item, ctx->tag);
+        mem_block_move(item->value, ctx->tag);
+    }
+}
+
+/* Number of allocation sites listed when blocks are leaked */
+#define LEAK_REPORT_GROUPS 10
+
+/* Show the allocated blocks grouped by allocating line and call stack */
+static void show_leaks(void)
+{
+    leak_stat_t stat[LEAK_REPORT_GROUPS];
+    size_t n = leak_stats(stat, LEAK_REPORT_GROUPS);
+    for (size_t i = 0; i < n; i++) {
+        report(1, "%zu blocks, %zu bytes allocated at %s", stat[i].blocks,
+               stat[i].bytes, stat[i].site);
+
+        size_t depth;
+        char **frame = stack_symbols(stat[i].stack, &depth);
+        if (!frame)
+            continue;
+        for (size_t k = 0; k < depth; k++)
+            report(1, "    %s", frame[k]);
+        free(frame);
+    }
+}
+
 static bool do_free(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -101,9 +243,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = (current->chain.next == &chain.head) ? chain.head.next
@@ -113,16 +252,20 @@ static bool do_free(int argc, char *argv[])
     if (current) {
         list_del(&current->chain);
 
-        if (exception_setup(true))
+        queue_drop_tree(current);
+        queue_drop_filter(current);
+        if (exception_setup(true)) {
+            q_index_free(&current->index);
             q_free(current->q);
+        }
         exception_cancel();
-        set_cautious_mode(true);
     }
 
     if (current) {
+        mem_tag_release(current->tag);
         free(current);
         chain.size--;
-        current = qnext ? list_entry(qnext, queue_contex_t, chain) : NULL;
+        queue_select(qnext ? list_entry(qnext, queue_contex_t, chain) : NULL);
     }
 
     q_show(3);
@@ -132,12 +275,35 @@ static bool do_free(int argc, char *argv[])
         report(1,
                "ERROR: There is no queue, but %lu blocks are still allocated",
                bcnt);
+        show_leaks();
         ok = false;
     }
 
     return ok && !error_check();
 }
 
+/* Append a new empty queue to the chain. Must be called within
+ * exception_setup() since it runs q_new().
+ */
+static queue_contex_t *queue_new_context()
+{
+    queue_contex_t *qctx = malloc(sizeof(queue_contex_t));
+    list_add_tail(&qctx->chain, &chain.head);
+
+    qctx->size = 0;
+    qctx->tag = mem_tag_new();
+    /* Charge the head to the new queue, but stay on the current one */
+    mem_tag_set(qctx->tag);
+    qctx->q = q_new();
+    mem_tag_set(current ? current->tag : 0);
+    qctx->id = chain.size++;
+    qctx->sorted = 0;
+    memset(&qctx->index, 0, sizeof(q_index_t));
+    qctx->tree = NULL;
+    qctx->filter = NULL;
+    return qctx;
+}
+
 static bool do_new(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -147,16 +313,8 @@ static bool do_new(int argc, char *argv[])
 
     bool ok = true;
 
-    if (exception_setup(true)) {
-        queue_contex_t *qctx = malloc(sizeof(queue_contex_t));
-        list_add_tail(&qctx->chain, &chain.head);
-
-        qctx->size = 0;
-        qctx->q = q_new();
-        qctx->id = chain.size++;
-
-        current = qctx;
-    }
+    if (exception_setup(true))
+        queue_select(queue_new_context());
     exception_cancel();
     q_show(3);
 
@@ -201,7 +359,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
 
     char *lasts = NULL;
     char randstr_buf[MAX_RANDSTR_LEN];
-    int reps = 1;
+    size_t reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
         report(1, "%s needs 1-2 arguments", argv[0]);
@@ -210,7 +368,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
 
     char *inserts = argv[1];
     if (argc == 3) {
-        if (!get_int(argv[2], &reps)) {
+        if (!get_size(argv[2], &reps)) {
             report(1, "Invalid number of insertions '%s'", argv[2]);
             return false;
         }
@@ -226,8 +384,9 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                pos == POS_TAIL ? "tail" : "head");
     error_check();
 
+    queue_unsorted(current);
     if (current && exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
+        for (size_t r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
             bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
@@ -238,6 +397,13 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                     pos == POS_TAIL
                         ? list_last_entry(current->q, element_t, list)
                         : list_first_entry(current->q, element_t, list);
+                if (current->tree &&
+                    !ost_insert(current->tree,
+                                pos == POS_TAIL ? current->size - 1 : 0,
+                                &entry->list))
+                    queue_drop_tree(current);
+                if (current->filter)
+                    bloom_add(current->filter, entry->value);
                 char *cur_inserts = entry->value;
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
@@ -258,11 +424,11 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                 lasts = cur_inserts;
             } else {
                 fail_count++;
-                if (fail_count < fail_limit)
+                if (fail_count < (size_t) fail_limit)
                     report(2, "Insertion of %s failed", inserts);
                 else {
                     report(1,
-                           "ERROR: Insertion of %s failed (%d failures total)",
+                           "ERROR: Insertion of %s failed (%zu failures total)",
                            inserts, fail_count);
                     ok = false;
                 }
@@ -349,6 +515,7 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
     error_check();
 
     element_t *re = NULL;
+    queue_drop_index(current);
     if (current && exception_setup(true))
         re = pos == POS_TAIL
                  ? q_remove_tail(current->q, removes, string_length + 1)
@@ -358,6 +525,15 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
     bool is_null = re ? false : true;
 
     if (!is_null) {
+        /* Keep the tree only if it agrees on which node left the queue */
+        if (current->tree &&
+            ost_remove(current->tree, pos == POS_TAIL ? current->size - 1
+                                                      : 0) != &re->list)
+            queue_drop_tree(current);
+
+        if (current->filter)
+            bloom_remove(current->filter, re->value);
+
         // q_remove_head and q_remove_tail are not responsible for releasing
         // node
         q_release_element(re);
@@ -385,10 +561,10 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
         current->size--;
     } else {
         fail_count++;
-        if (!check && fail_count < fail_limit) {
+        if (!check && fail_count < (size_t) fail_limit) {
             report(2, "Removal from queue failed");
         } else {
-            report(1, "ERROR: Removal from queue failed (%d failures total)",
+            report(1, "ERROR: Removal from queue failed (%zu failures total)",
                    fail_count);
             ok = false;
         }
@@ -429,12 +605,21 @@ static bool do_dedup(int argc, char *argv[])
         return false;
     }
 
+    /* Values known to be distinct leave nothing to delete */
+    if (current->size && queue_filter(current) &&
+        bloom_distinct(current->filter)) {
+        report(2, "No duplicate strings in queue, nothing to delete");
+        q_show(3);
+        return !error_check();
+    }
+
     LIST_HEAD(l_copy);
     element_t *item = NULL, *tmp = NULL;
+    struct list_head *ahead;
 
     // Copy current->q to l_copy
     if (current->q && !list_empty(current->q)) {
-        list_for_each_entry (item, current->q, list) {
+        list_for_each_entry_prefetch (item, ahead, current->q, list, value) {
             size_t slen;
             tmp = malloc(sizeof(element_t));
             if (!tmp)
@@ -463,6 +648,9 @@ static bool do_dedup(int argc, char *argv[])
     }
 
     bool ok = true;
+    queue_drop_index(current);
+    queue_drop_tree(current);
+    queue_drop_filter(current);
     if (exception_setup(true))
         ok = q_delete_dup(current->q);
     exception_cancel();
@@ -523,9 +711,16 @@ static bool do_reverse(int argc, char *argv[])
         report(3, "Warning: Calling reverse on null queue");
     error_check();
 
+    if (current) {
+        current->sorted = -current->sorted;
+        queue_drop_index(current);
+    }
     set_noallocate_mode(true);
-    if (current && exception_setup(true))
+    if (current && exception_setup(true)) {
         q_reverse(current->q);
+        if (current->tree)
+            ost_reverse(current->tree, 0, current->size);
+    }
     exception_cancel();
 
     set_noallocate_mode(false);
@@ -547,7 +742,7 @@ static bool do_size(int argc, char *argv[])
             report(1, "Invalid number of calls to size '%s'", argv[2]);
     }
 
-    int cnt = 0;
+    size_t cnt = 0;
     if (!current || !current->q)
         report(3, "Warning: Calling size on null queue");
     error_check();
@@ -562,11 +757,12 @@ static bool do_size(int argc, char *argv[])
 
     if (current && ok) {
         if (current->size == cnt) {
-            report(2, "Queue size = %d", cnt);
+            report(2, "Queue size = %zu", cnt);
         } else {
             report(1,
-                   "ERROR: Computed queue size as %d, but correct value is %d",
-                   cnt, (int) current->size);
+                   "ERROR: Computed queue size as %zu, but correct value is "
+                   "%zu",
+                   cnt, current->size);
             ok = false;
         }
     }
@@ -576,6 +772,64 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Natural order: runs of digits compare by numeric value, and before any
+ * other character.
+ */
+static int natural_cmp(const char *a, const char *b)
+{
+    while (*a && *b) {
+        bool da = isdigit((unsigned char) *a), db = isdigit((unsigned char) *b);
+        if (da && db) {
+            while (*a == '0' && isdigit((unsigned char) a[1]))
+                a++;
+            while (*b == '0' && isdigit((unsigned char) b[1]))
+                b++;
+            size_t la = 0, lb = 0;
+            while (isdigit((unsigned char) a[la]))
+                la++;
+            while (isdigit((unsigned char) b[lb]))
+                lb++;
+            if (la != lb)
+                return la < lb ? -1 : 1;
+            int r = strncmp(a, b, la);
+            if (r)
+                return r;
+            a += la;
+            b += lb;
+            continue;
+        }
+        if (da != db)
+            return da ? -1 : 1;
+        if (*a != *b)
+            break;
+        a++;
+        b++;
+    }
+    return (unsigned char) *a - (unsigned char) *b;
+}
+
+/* Compare two values in the order selected by sortkey. This does not use
+ * sort keys, so that it can check them.
+ */
+static int sort_compare(const char *a, const char *b)
+{
+    size_t la, lb;
+    switch (sort_key) {
+    case 1:
+        return natural_cmp(a, b);
+    case 2:
+        return strcasecmp(a, b);
+    case 3:
+        la = strlen(a);
+        lb = strlen(b);
+        if (la != lb)
+            return la < lb ? -1 : 1;
+        return strcmp(a, b);
+    default:
+        return strcmp(a, b);
+    }
+}
+
 bool do_sort(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -583,7 +837,7 @@ bool do_sort(int argc, char *argv[])
         return false;
     }
 
-    int cnt = 0;
+    size_t cnt = 0;
     if (!current || !current->q)
         report(3, "Warning: Calling sort on null queue");
     else
@@ -594,7 +848,13 @@ bool do_sort(int argc, char *argv[])
         report(3, "Warning: Calling sort on single node");
     error_check();
 
-    set_noallocate_mode(true);
+    if (sort_key < 0 || sort_key >= SORT_KEYS) {
+        report(1, "ERROR: Unknown sort key %d", sort_key);
+        return false;
+    }
+
+    /* Only q_sort() is required to sort without allocating */
+    set_noallocate_mode(!sort_key);
 
 /* If the number of elements is too large, it may take a long time to check the
  * stability of the sort. So, MAX_NODES is used to limit the number of elements
@@ -603,42 +863,63 @@ bool do_sort(int argc, char *argv[])
     struct list_head *nodes[MAX_NODES];
     unsigned no = 0;
     if (current && current->size && current->size <= MAX_NODES) {
-        element_t *entry;
-        list_for_each_entry (entry, current->q, list)
-            nodes[no++] = &entry->list;
+        struct list_head *node, *ahead;
+        list_for_each_prefetch (node, ahead, current->q)
+            nodes[no++] = node;
     } else if (current && current->size > MAX_NODES)
         report(1,
                "Warning: Skip checking the stability of the sort because the "
-               "number of elements %d is too large, exceeds the limit %d.",
+               "number of elements %zu is too large, exceeds the limit %d.",
                current->size, MAX_NODES);
 
-    if (current && exception_setup(true))
-        q_sort(current->q, descend);
+    static const q_key_fn sort_keys[SORT_KEYS] = {q_key_plain, q_key_natural,
+                                                  q_key_nocase, q_key_length};
+    bool sorted = true;
+    if (current && exception_setup(true)) {
+        if (!sort_key)
+            q_sort(current->q, descend);
+        else
+            sorted = q_sort_by(current->q, q_key_cmp, sort_keys[sort_key],
+                               descend);
+    }
     exception_cancel();
     set_noallocate_mode(false);
 
     bool ok = true;
-    if (current && current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
+    if (!sorted) {
+        fail_count++;
+        if (fail_count < (size_t) fail_limit) {
+            report(2, "Sort by key failed to allocate keys");
+        } else {
+            report(1, "ERROR: Sort by key failed (%zu failures total)",
+                   fail_count);
+            ok = false;
+        }
+    } else if (current && current->size) {
+        struct list_head *head = current->q;
+        struct list_head *ahead = list_prefetch_start(head->next, head);
+        for (struct list_head *cur_l = head->next; cur_l != head && --cnt;
+             cur_l = cur_l->next) {
+            ahead = list_prefetch_next(ahead, head);
+            list_prefetch_field(ahead, head, element_t, list, value);
             /* Ensure each element in ascending/descending order */
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
             next_item = list_entry(cur_l->next, element_t, list);
-            if (!descend && strcmp(item->value, next_item->value) > 0) {
+            int r = sort_compare(item->value, next_item->value);
+            if (!descend && r > 0) {
                 report(1, "ERROR: Not sorted in ascending order");
                 ok = false;
                 break;
             }
 
-            if (descend && strcmp(item->value, next_item->value) < 0) {
+            if (descend && r < 0) {
                 report(1, "ERROR: Not sorted in descending order");
                 ok = false;
                 break;
             }
             /* Ensure the stability of the sort */
-            if (current->size <= MAX_NODES &&
-                !strcmp(item->value, next_item->value)) {
+            if (current->size <= MAX_NODES && !r) {
                 bool unstable = false;
                 for (unsigned i = 0; i < MAX_NODES; i++) {
                     if (nodes[i] == cur_l->next) {
@@ -663,6 +944,11 @@ bool do_sort(int argc, char *argv[])
     }
 #undef MAX_NODES
 
+    /* Searching relies on strcmp order */
+    if (ok && sorted && !sort_key)
+        queue_sorted(current, descend);
+    else
+        queue_reordered(current);
     q_show(3);
     return ok && !error_check();
 }
@@ -681,8 +967,26 @@ static bool do_dm(int argc, char *argv[])
     error_check();
 
     bool ok = true;
-    if (exception_setup(true))
-        ok = q_delete_mid(current->q);
+    queue_drop_index(current);
+    queue_drop_filter(current);
+    if (!use_ostree)
+        queue_drop_tree(current);
+    if (exception_setup(true)) {
+        if (!use_ostree) {
+            ok = q_delete_mid(current->q);
+        } else if (!current->size) {
+            ok = false;
+        } else if (queue_tree(current)) {
+            /* The middle node is found and unlinked in O(log n) */
+            struct list_head *mid =
+                ost_remove(current->tree, current->size / 2);
+            list_del(mid);
+            q_release_element(list_entry(mid, element_t, list));
+        } else {
+            report(1, "INTERNAL ERROR.  Could not build order-statistics tree");
+            ok = false;
+        }
+    }
     exception_cancel();
 
     if (!current->size)
@@ -706,6 +1010,7 @@ static bool do_swap(int argc, char *argv[])
     }
     error_check();
 
+    queue_reordered(current);
     set_noallocate_mode(true);
     if (exception_setup(true))
         q_swap(current->q);
@@ -732,13 +1037,15 @@ static bool do_ascend(int argc, char *argv[])
     error_check();
 
 
-    int cnt = q_size(current->q);
+    size_t cnt = q_size(current->q);
     if (!cnt)
         report(3, "Warning: Calling ascend on empty queue");
     else if (cnt < 2)
         report(3, "Warning: Calling ascend on single node");
     error_check();
 
+    queue_reordered(current);
+    queue_drop_filter(current);
     if (exception_setup(true))
         current->size = q_ascend(current->q);
     set_noallocate_mode(false);
@@ -761,6 +1068,8 @@ static bool do_ascend(int argc, char *argv[])
         }
     }
 
+    if (ok)
+        queue_sorted(current, false);
     q_show(3);
     return ok && !error_check();
 }
@@ -779,13 +1088,15 @@ static bool do_descend(int argc, char *argv[])
     error_check();
 
 
-    int cnt = q_size(current->q);
+    size_t cnt = q_size(current->q);
     if (!cnt)
         report(3, "Warning: Calling descend on empty queue");
     else if (cnt < 2)
         report(3, "Warning: Calling descend on single node");
     error_check();
 
+    queue_reordered(current);
+    queue_drop_filter(current);
     if (exception_setup(true))
         current->size = q_descend(current->q);
     set_noallocate_mode(false);
@@ -808,13 +1119,31 @@ static bool do_descend(int argc, char *argv[])
         }
     }
 
+    if (ok)
+        queue_sorted(current, true);
     q_show(3);
     return ok && !error_check();
 }
 
+/* Reverse each group of k nodes in the list and in the tree. Relinking the
+ * list still takes O(k) per group, so O(n) in all as with q_reverseK(); the
+ * tree follows in O(log n) per group, which saves rebuilding it for dm.
+ */
+static void tree_reverseK(queue_contex_t *ctx, size_t k)
+{
+    struct list_head *prev = ctx->q;
+    for (size_t pos = 0; pos + k <= ctx->size; pos += k) {
+        struct list_head *first = prev->next;
+        for (size_t i = 1; i < k; i++)
+            list_move(first->next, prev);
+        ost_reverse(ctx->tree, pos, k);
+        prev = first;
+    }
+}
+
 static bool do_reverseK(int argc, char *argv[])
 {
-    int k = 0;
+    size_t k = 0;
 
     if (!current || !current->q) {
         report(3, "Warning: Calling reverseK on null queue");
@@ -823,7 +1152,7 @@ static bool do_reverseK(int argc, char *argv[])
     error_check();
 
     if (argc == 2) {
-        if (!get_int(argv[1], &k)) {
+        if (!get_size(argv[1], &k)) {
             report(1, "Invalid number of K");
             return false;
         }
@@ -832,9 +1161,18 @@ static bool do_reverseK(int argc, char *argv[])
         return false;
     }
 
+    bool backend = use_ostree && k > 0 && queue_tree(current);
+    if (backend)
+        queue_unsorted(current);
+    else
+        queue_reordered(current);
     set_noallocate_mode(true);
-    if (exception_setup(true))
-        q_reverseK(current->q, k);
+    if (exception_setup(true)) {
+        if (backend)
+            tree_reverseK(current, k);
+        else
+            q_reverseK(current->q, k);
+    }
     exception_cancel();
 
     set_noallocate_mode(false);
@@ -855,7 +1193,14 @@ static bool do_merge(int argc, char *argv[])
     }
     error_check();
 
-    int len = 0;
+    /* Nodes move between queues, so no index survives the merge */
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, &chain.head, chain) {
+        queue_reordered(ctx);
+        queue_drop_filter(ctx);
+    }
+
+    size_t len = 0;
     set_noallocate_mode(true);
     if (current && exception_setup(true))
         len = q_merge(&chain.head, descend);
@@ -864,7 +1209,7 @@ static bool do_merge(int argc, char *argv[])
 
     if (q_size(&chain.head) > 1) {
         chain.size = 1;
-        current = list_entry(chain.head.next, queue_contex_t, chain);
+        queue_select(list_entry(chain.head.next, queue_contex_t, chain));
         current->size = len;
 
         struct list_head *cur = chain.head.next->next;
@@ -872,6 +1217,9 @@ static bool do_merge(int argc, char *argv[])
             queue_contex_t *ctx = list_entry(cur, queue_contex_t, chain);
             cur = cur->next;
             q_free(ctx->q);
+            /* Its nodes now belong to the first queue */
+            mem_tag_move(ctx->tag, current->tag);
+            mem_tag_release(ctx->tag);
             free(ctx);
         }
 
@@ -909,149 +1257,1450 @@ static bool do_merge(int argc, char *argv[])
         }
     }
 
+    if (ok)
+        queue_sorted(current, descend);
     q_show(3);
     return ok && !error_check();
 }
 
-static bool is_circular()
+/* Find the queue with the given id in the chain */
+static queue_contex_t *queue_find_id(int id)
 {
-    struct list_head *cur = current->q->next;
-    struct list_head *fast = (cur) ? cur->next : NULL;
-    while (cur != current->q) {
-        if (!cur || !fast || !fast->next)
-            return false;
-        if (cur == fast)
-            return false;
-        cur = cur->next;
-        fast = fast->next->next;
-    }
-
-    cur = current->q->prev;
-    fast = (cur) ? cur->prev : NULL;
-    while (cur != current->q) {
-        if (!cur || !fast || !fast->prev)
-            return false;
-        cur = cur->prev;
-        fast = fast->prev->prev;
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, &chain.head, chain) {
+        if (ctx->id == id)
+            return ctx;
     }
-    return true;
+    return NULL;
 }
 
-static bool q_show(int vlevel)
+typedef enum { SET_UNION, SET_INTERSECT, SET_DIFF } set_op_t;
+
+/* Combine the current queue with the queue given by id */
+static bool set_operation(int argc, char *argv[], set_op_t op)
 {
-    bool ok = true;
-    if (verblevel < vlevel)
-        return true;
+    int id = 0;
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
 
-    int cnt = 0;
-    if (!current || !current->q) {
-        report(vlevel, "l = NULL");
-        return true;
+    if (!get_int(argv[1], &id)) {
+        report(1, "Invalid queue id '%s'", argv[1]);
+        return false;
     }
 
-    if (!is_circular()) {
-        report(vlevel, "ERROR:  Queue is not doubly circular");
+    if (!current || !current->q) {
+        report(3, "Warning: Calling %s on null queue", argv[0]);
         return false;
     }
+    error_check();
 
-    report_noreturn(vlevel, "l = [");
+    queue_contex_t *other = queue_find_id(id);
+    if (!other || !other->q) {
+        report(1, "ERROR: No queue with id %d", id);
+        return false;
+    }
+    if (other == current) {
+        report(1, "ERROR: Cannot combine queue %d with itself", id);
+        return false;
+    }
 
-    struct list_head *ori = current->q;
-    struct list_head *cur = current->q->next;
+    /* Nodes sorted alike are merged in place, anything else is appended */
+    bool stays_sorted = op != SET_UNION || current->sorted == other->sorted;
+    queue_drop_index(current);
+    queue_drop_tree(current);
+    queue_drop_filter(current);
+    if (!stays_sorted)
+        queue_unsorted(current);
+    if (op == SET_UNION) {
+        queue_reordered(other);
+        queue_drop_filter(other);
+    }
 
+    ssize_t len = -1;
     if (exception_setup(true)) {
-        while (ok && ori != cur && cnt < current->size) {
-            element_t *e = list_entry(cur, element_t, list);
-            if (cnt < BIG_LIST_SIZE) {
-                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
-                if (show_entropy) {
-                    report_noreturn(
-                        vlevel, "(%3.2f%%)",
-                        shannon_entropy((const uint8_t *) e->value));
-                }
-            }
-            cnt++;
-            cur = cur->next;
-            ok = ok && !error_check();
-        }
+        if (op == SET_UNION)
+            len = q_union(current->q, other->q);
+        else if (op == SET_INTERSECT)
+            len = q_intersect(current->q, other->q);
+        else
+            len = q_diff(current->q, other->q);
     }
     exception_cancel();
 
-    if (!ok) {
-        report(vlevel, " ... ]");
-        return false;
-    }
+    current->size = q_size(current->q);
+    other->size = q_size(other->q);
+    if (op == SET_UNION)
+        queue_retag(current);
 
-    if (cur == ori) {
-        if (cnt <= BIG_LIST_SIZE)
-            report(vlevel, "]");
-        else
-            report(vlevel, " ... ]");
-    } else {
-        report(vlevel, " ... ]");
-        report(vlevel, "ERROR:  Queue has more than %d elements",
+    bool ok = true;
+    if (len < 0) {
+        fail_count++;
+        if (fail_count < (size_t) fail_limit) {
+            report(2, "%s failed to allocate its hash table", argv[0]);
+        } else {
+            report(1, "ERROR: %s failed (%zu failures total)", argv[0],
+                   fail_count);
+            ok = false;
+        }
+    } else if ((size_t) len != current->size) {
+        report(1, "ERROR: Returned %zd elements, but queue has %zu", len,
                current->size);
         ok = false;
+    } else if (op == SET_UNION && other->size) {
+        report(1, "ERROR: Queue %d still has %zu elements after union",
+               other->id, other->size);
+        ok = false;
     }
 
-    return ok;
+    q_show(3);
+    return ok && !error_check();
 }
 
-static bool do_show(int argc, char *argv[])
+static bool do_union(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
-        return false;
-    }
+    return set_operation(argc, argv, SET_UNION);
+}
 
-    if (current)
-        report(1, "Current queue ID: %d", current->id);
+static bool do_intersect(int argc, char *argv[])
+{
+    return set_operation(argc, argv, SET_INTERSECT);
+}
 
-    return q_show(0);
+static bool do_diff(int argc, char *argv[])
+{
+    return set_operation(argc, argv, SET_DIFF);
 }
 
-static bool do_prev(int argc, char *argv[])
+static bool do_split(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    size_t k = 0;
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
         return false;
     }
 
-    if (!current) {
-        report(3, "Warning: Try to operate null queue");
+    if (!get_size(argv[1], &k)) {
+        report(1, "Invalid number of elements '%s'", argv[1]);
         return false;
     }
 
-    struct list_head *prev;
-    if (chain.size > 1) {
-        prev = ((uintptr_t) chain.head.next == (uintptr_t) &current->chain)
-                   ? chain.head.prev
-                   : current->chain.prev;
-        current = prev ? list_entry(prev, queue_contex_t, chain) : NULL;
-    }
-
-    return q_show(0);
-}
-
-static bool do_next(int argc, char *argv[])
-{
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    if (!current || !current->q) {
+        report(3, "Warning: Calling split on null queue");
         return false;
     }
+    error_check();
 
-    if (!current) {
-        report(3, "Warning: Try to operate null queue");
+    /* The destination has to exist before allocation is disallowed */
+    queue_contex_t *src = current, *dst = NULL;
+    if (exception_setup(true))
+        dst = queue_new_context();
+    exception_cancel();
+    if (!dst || !dst->q) {
+        report(1, "ERROR: Could not create queue for split elements");
         return false;
     }
 
-    struct list_head *next;
-    if (chain.size > 1) {
-        next = ((uintptr_t) chain.head.prev == (uintptr_t) &current->chain)
-                   ? chain.head.next
-                   : current->chain.next;
-        current = next ? list_entry(next, queue_contex_t, chain) : NULL;
-    }
+    /* Both parts keep the order of the queue, but not its positions */
+    size_t moved = 0, expect = k < src->size ? k : src->size;
+    queue_drop_index(src);
+    queue_drop_tree(src);
+    queue_drop_filter(src);
+    set_noallocate_mode(true);
+    if (exception_setup(true))
+        moved = q_split(src->q, k, dst->q);
+    exception_cancel();
+    set_noallocate_mode(false);
+
+    src->size -= moved;
+    dst->size = moved;
+    dst->sorted = src->sorted;
+    queue_retag(dst);
+
+    bool ok = true;
+    if (moved != expect) {
+        report(1, "ERROR: Split %zu elements, expected %zu", moved, expect);
+        ok = false;
+    }
+    if (q_size(src->q) != src->size || q_size(dst->q) != dst->size) {
+        report(1, "ERROR: Queue sizes do not match after split");
+        ok = false;
+    }
+
+    report(2, "Moved %zu elements into queue %d", moved, dst->id);
+    q_show(3);
+    return ok && !error_check();
+}
+
+static bool do_rotate(int argc, char *argv[])
+{
+    ssize_t k = 1;
+    if (argc > 2) {
+        report(1, "%s takes at most 1 argument", argv[0]);
+        return false;
+    }
+
+    if (argc == 2 && !get_ssize(argv[1], &k)) {
+        report(1, "Invalid number of elements '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling rotate on null queue");
+        return false;
+    }
+    error_check();
+
+    /* Element expected at the front once rotated */
+    element_t *expect = NULL;
+    if (current->size) {
+        ssize_t pos = k % (ssize_t) current->size;
+        if (pos < 0)
+            pos += current->size;
+        struct list_head *node = current->q->next;
+        while (pos--)
+            node = node->next;
+        expect = list_entry(node, element_t, list);
+    }
+
+    if (current->size > 1)
+        queue_reordered(current);
+    set_noallocate_mode(true);
+    if (exception_setup(true))
+        q_rotate(current->q, k);
+    exception_cancel();
+    set_noallocate_mode(false);
+
+    bool ok = true;
+    if (expect && current->q->next != &expect->list) {
+        report(1, "ERROR: Queue should start with %s after rotation",
+               expect->value);
+        ok = false;
+    }
+    if (q_size(current->q) != current->size) {
+        report(1, "ERROR: Queue has %zu elements after rotation, expected %zu",
+               q_size(current->q), current->size);
+        ok = false;
+    }
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+static bool do_concat(int argc, char *argv[])
+{
+    int id = 0;
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    if (!get_int(argv[1], &id)) {
+        report(1, "Invalid queue id '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling concat on null queue");
+        return false;
+    }
+    error_check();
+
+    queue_contex_t *src = queue_find_id(id);
+    if (!src || !src->q) {
+        report(1, "ERROR: No queue with id %d", id);
+        return false;
+    }
+    if (src == current) {
+        report(1, "ERROR: Cannot append queue %d to itself", id);
+        return false;
+    }
+
+    if (src->size) {
+        queue_reordered(current);
+        queue_drop_filter(current);
+    }
+    queue_reordered(src);
+    queue_drop_filter(src);
+    set_noallocate_mode(true);
+    if (exception_setup(true))
+        q_concat(current->q, src->q);
+    exception_cancel();
+    set_noallocate_mode(false);
+
+    current->size += src->size;
+    src->size = 0;
+    queue_retag(current);
+
+    bool ok = true;
+    if (!list_empty(src->q) || q_size(current->q) != current->size) {
+        report(1, "ERROR: Queue %d should have been appended entirely", id);
+        ok = false;
+    }
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+/* Average distance in bytes between the addresses of consecutive nodes */
+static double queue_locality(const queue_contex_t *ctx)
+{
+    if (ctx->size < 2)
+        return 0;
+
+    double total = 0;
+    uintptr_t prev = (uintptr_t) ctx->q->next;
+    struct list_head *node, *ahead;
+    list_for_each_prefetch (node, ahead, ctx->q) {
+        uintptr_t addr = (uintptr_t) node;
+        total += addr > prev ? addr - prev : prev - addr;
+        prev = addr;
+    }
+    return total / (ctx->size - 1);
+}
+
+static bool do_locality(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling locality on null queue");
+        return false;
+    }
+    error_check();
+
+    report(1, "Average distance between consecutive nodes: %.1f bytes",
+           queue_locality(current));
+    return !error_check();
+}
+
+static bool do_defrag(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling defrag on null queue");
+        return false;
+    }
+    error_check();
+
+    /* Lay the copies out one after the other in fresh arena memory, where
+     * the blocks released meanwhile cannot be handed out again.
+     */
+    double before = queue_locality(current);
+    bool moved = false, carving = arena_carve(true);
+    if (exception_setup(true))
+        moved = q_defrag(current->q);
+    exception_cancel();
+    arena_carve(carving);
+
+    bool ok = true;
+    /* The nodes moved, so nothing may point to the old ones */
+    queue_drop_index(current);
+    queue_drop_tree(current);
+    if (!moved) {
+        fail_count++;
+        if (fail_count < (size_t) fail_limit) {
+            report(2, "Defrag failed to allocate copies");
+        } else {
+            report(1, "ERROR: Defrag failed (%zu failures total)", fail_count);
+            ok = false;
+        }
+    } else {
+        if (q_size(current->q) != current->size) {
+            report(1,
+                   "ERROR: Queue has %zu elements after defrag, expected %zu",
+                   q_size(current->q), current->size);
+            ok = false;
+        }
+        report(2, "Average distance between consecutive nodes: %.1f -> %.1f "
+                  "bytes",
+               before, queue_locality(current));
+    }
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+static bool do_arena(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    size_t mapped, used, rss, huge;
+    bool known = arena_usage(&mapped, &used, &rss, &huge);
+    report(1, "Arena mode %s: %zu KiB mapped, %zu KiB in blocks",
+           arena_mode ? "on" : "off", mapped >> 10, used >> 10);
+    if (!known)
+        report(1, "Huge page coverage unknown");
+    else if (rss)
+        report(1, "%zu KiB resident, %zu KiB on huge pages (%.1f%%)",
+               rss >> 10, huge >> 10, 100.0 * huge / rss);
+    return true;
+}
+
+static bool do_leaks(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    show_leaks();
+    return true;
+}
+
+/* Blocks handed over between the threads of the threads command */
+#define THREAD_SLOTS 1024
+static void *thread_slot[THREAD_SLOTS];
+static int thread_ops;
+
+/* Allocate, resize and free blocks at random. A block is left in a random
+ * slot, so that it is usually freed by another thread than its own.
+ */
+static void *thread_run(void *arg)
+{
+    uintptr_t rng = (uintptr_t) arg;
+    for (int i = 0; i < thread_ops; i++) {
+        rng = random_shuffle(rng);
+        void **slot = &thread_slot[rng % THREAD_SLOTS];
+        void *p = __atomic_exchange_n(slot, NULL, __ATOMIC_ACQ_REL);
+        if (p) {
+            test_free(p);
+            continue;
+        }
+
+        size_t size = 1 + (rng >> 16) % 512;
+        if (!(p = test_malloc(size)))
+            continue;
+        memset(p, 0, size);
+        if (rng >> 40 & 1) {
+            size = 1 + (rng >> 24) % 512;
+            void *q = test_realloc(p, size);
+            if (q)
+                p = q;
+        }
+        void *empty = NULL;
+        if (!__atomic_compare_exchange_n(slot, &empty, p, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            test_free(p);
+    }
+    return NULL;
+}
+
+static bool do_threads(int argc, char *argv[])
+{
+    int nthreads;
+    if (argc != 3 || !get_int(argv[1], &nthreads) || nthreads < 1 ||
+        !get_int(argv[2], &thread_ops) || thread_ops < 0) {
+        report(1, "%s takes a number of threads and of operations", argv[0]);
+        return false;
+    }
+    error_check();
+
+    pthread_t *thread = malloc(nthreads * sizeof(pthread_t));
+    if (!thread) {
+        report(1, "INTERNAL ERROR.  Could not allocate threads");
+        return false;
+    }
+
+    size_t before = allocation_check();
+    int started = 0;
+    while (started < nthreads &&
+           !pthread_create(&thread[started], NULL, thread_run,
+                           (void *) (uintptr_t) (started + 1)))
+        started++;
+    for (int i = 0; i < started; i++)
+        pthread_join(thread[i], NULL);
+    free(thread);
+
+    for (size_t k = 0; k < THREAD_SLOTS; k++) {
+        test_free(thread_slot[k]);
+        thread_slot[k] = NULL;
+    }
+
+    bool ok = started == nthreads;
+    if (!ok)
+        report(1, "ERROR: Could only start %d threads", started);
+    size_t after = allocation_check();
+    if (after != before) {
+        report(1, "ERROR: %zu blocks allocated before the threads, %zu after",
+               before, after);
+        ok = false;
+    }
+    return ok && !error_check();
+}
+
+/* Show the memory charged to tag, per element if there are elements */
+static void show_mem(const char *name, unsigned tag, size_t elements)
+{
+    mem_stat_t stat;
+    mem_stats(tag, &stat);
+    double total = stat.bytes + stat.overhead;
+    report_noreturn(1, "%s: %zu bytes in %zu blocks, peak %zu, %zu allocations",
+                    name, stat.bytes, stat.blocks, stat.peak, stat.allocs);
+    if (stat.bytes)
+        report_noreturn(1, ", overhead %.2f", total / stat.bytes);
+    if (elements)
+        report_noreturn(1, ", %.1f bytes per element", total / elements);
+    report(1, "");
+}
+
+static bool do_mem(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, &chain.head, chain) {
+        char name[32];
+        snprintf(name, sizeof(name), "Queue %d", ctx->id);
+        show_mem(name, ctx->tag, ctx->size);
+    }
+
+    mem_stat_t other;
+    mem_stats(0, &other);
+    if (other.blocks)
+        show_mem("Other", 0, 0);
+    return true;
+}
+
+/* Counters and time of the previous memstats, for the rates */
+static mem_class_t memstats_last[MEM_CLASSES];
+static double memstats_time;
+
+static bool do_memstats(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes at most one argument", argv[0]);
+        return false;
+    }
+
+    FILE *dump = NULL;
+    if (argc == 2 && !(dump = fopen(argv[1], "w"))) {
+        report(1, "Couldn't open '%s'", argv[1]);
+        return false;
+    }
+
+    mem_class_t stat[MEM_CLASSES];
+    mem_classes(stat);
+    double interval = delta_time(&memstats_time);
+    if (dump)
+        fprintf(dump, "min,max,blocks,bytes,peak,allocs,frees,alloc_rate,"
+                      "free_rate\n");
+
+    for (size_t k = 0; k < MEM_CLASSES; k++) {
+        const mem_class_t *c = &stat[k];
+        if (!c->allocs)
+            continue;
+
+        /* The largest class ends at SIZE_MAX, as lo << 1 wraps to 0 */
+        size_t lo = k ? (size_t) 1 << (k - 1) : 0;
+        size_t hi = k ? (lo << 1) - 1 : 0;
+        double allocs = c->allocs - memstats_last[k].allocs;
+        double frees = c->frees - memstats_last[k].frees;
+        if (interval > 0) {
+            allocs /= interval;
+            frees /= interval;
+        }
+
+        if (dump) {
+            fprintf(dump, "%zu,%zu,%zu,%zu,%zu,%zu,%zu,%.0f,%.0f\n", lo, hi,
+                    c->blocks, c->bytes, c->peak, c->allocs, c->frees, allocs,
+                    frees);
+        } else {
+            report(1,
+                   "%zu-%zu bytes: %zu blocks, %zu bytes, peak %zu, %zu "
+                   "allocated, %zu freed, %.0f allocs/s, %.0f frees/s",
+                   lo, hi, c->blocks, c->bytes, c->peak, c->allocs, c->frees,
+                   allocs, frees);
+        }
+    }
+    memcpy(memstats_last, stat, sizeof(stat));
+
+    if (dump)
+        fclose(dump);
+    return true;
+}
+
+static int fault_stat_cmp(const void *a, const void *b)
+{
+    return strcmp(((const fault_stat_t *) a)->site,
+                  ((const fault_stat_t *) b)->site);
+}
+
+static bool do_fault(int argc, char *argv[])
+{
+    static const struct {
+        const char *name;
+        fault_mode_t mode;
+    } modes[] = {
+        {"off", FAULT_NONE},
+        {"every", FAULT_EVERY},
+        {"at", FAULT_AT},
+        {"random", FAULT_RANDOM},
+    };
+
+    if (argc == 1) {
+        static fault_stat_t stat[FAULT_MAX_SITES];
+        size_t n = fault_stats(stat, FAULT_MAX_SITES);
+        qsort(stat, n, sizeof(fault_stat_t), fault_stat_cmp);
+        for (size_t i = 0; i < n; i++) {
+            if (stat[i].calls)
+                report(1, "%s: %zu calls, %zu failed", stat[i].site,
+                       stat[i].calls, stat[i].failures);
+        }
+        return true;
+    }
+
+    size_t m = 0;
+    while (m < sizeof(modes) / sizeof(modes[0]) &&
+           strcmp(argv[1], modes[m].name))
+        m++;
+    if (m == sizeof(modes) / sizeof(modes[0])) {
+        report(1, "Unknown fault mode '%s'", argv[1]);
+        return false;
+    }
+
+    /* A last argument which is not a number selects the call sites */
+    char *site = NULL;
+    if (argc > 2 && argv[argc - 1][strspn(argv[argc - 1], "0123456789")])
+        site = argv[--argc];
+
+    size_t arg[FAULT_MAX_ARGS];
+    size_t narg = argc - 2;
+    if (narg > FAULT_MAX_ARGS) {
+        report(1, "At most %d call numbers can be given", FAULT_MAX_ARGS);
+        return false;
+    }
+    for (size_t i = 0; i < narg; i++) {
+        if (!get_size(argv[i + 2], &arg[i])) {
+            report(1, "Invalid number '%s'", argv[i + 2]);
+            return false;
+        }
+    }
+
+    if (!fault_schedule(modes[m].mode, arg, narg, site)) {
+        report(1, "Invalid schedule for fault mode '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
+/* Build the search index of a sorted queue on first use */
+static bool queue_index(queue_contex_t *ctx)
+{
+    if (!ctx->sorted || ctx->index.slot)
+        return true;
+    return q_index_build(ctx->q, &ctx->index, ctx->sorted < 0);
+}
+
+static bool do_contains(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling contains on null queue");
+        return false;
+    }
+    error_check();
+
+    if (!queue_filter(current)) {
+        report(1, "ERROR: Could not allocate Bloom filter");
+        return false;
+    }
+
+    if (bloom_maybe(current->filter, argv[1]))
+        report(1, "%s may be in queue", argv[1]);
+    else
+        report(1, "%s is definitely absent", argv[1]);
+    return !error_check();
+}
+
+static bool do_find(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling find on null queue");
+        return false;
+    }
+    error_check();
+
+    element_t *found = NULL;
+    if (exception_setup(true)) {
+        if (!queue_index(current))
+            report(3, "Warning: Could not build index, searching linearly");
+        found = q_find(current->q, current->sorted ? &current->index : NULL,
+                       argv[1]);
+    }
+    exception_cancel();
+
+    if (found && strcmp(found->value, argv[1])) {
+        report(1, "ERROR: Found %s while looking for %s", found->value,
+               argv[1]);
+        return false;
+    }
+    report(1, found ? "Found %s" : "%s is not in queue", argv[1]);
+    return !error_check();
+}
+
+static bool do_is(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling insert sorted on null queue");
+        return false;
+    }
+    error_check();
+
+    if (!current->size)
+        current->sorted = descend ? -1 : 1;
+    if (!current->sorted) {
+        report(1, "ERROR: Queue must be sorted before inserting in order");
+        return false;
+    }
+
+    bool ok = true;
+    queue_drop_tree(current);
+    if (exception_setup(true)) {
+        if (!queue_index(current))
+            report(3, "Warning: Could not build index, searching linearly");
+        if (q_insert_sorted(current->q, &current->index, argv[1])) {
+            current->size++;
+            if (current->filter)
+                bloom_add(current->filter, argv[1]);
+        } else {
+            fail_count++;
+            if (fail_count < (size_t) fail_limit)
+                report(2, "Insertion of %s failed", argv[1]);
+            else {
+                report(1, "ERROR: Insertion of %s failed (%zu failures total)",
+                       argv[1], fail_count);
+                ok = false;
+            }
+        }
+    }
+    exception_cancel();
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+static bool do_topk(int argc, char *argv[])
+{
+    size_t k = 0;
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    if (!get_size(argv[1], &k) || !k) {
+        report(1, "Invalid number of elements '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling topk on null queue");
+        return false;
+    }
+    error_check();
+
+    /* The destination has to exist before allocation is disallowed */
+    queue_contex_t *src = current, *dst = NULL;
+    if (exception_setup(true))
+        dst = queue_new_context();
+    exception_cancel();
+    if (!dst || !dst->q) {
+        report(1, "ERROR: Could not create queue for selected elements");
+        return false;
+    }
+
+    size_t moved = 0, expect = k < src->size ? k : src->size;
+    queue_reordered(src);
+    queue_drop_filter(src);
+    set_noallocate_mode(true);
+    if (exception_setup(true))
+        moved = q_topk(src->q, k, dst->q, descend);
+    exception_cancel();
+    set_noallocate_mode(false);
+
+    src->size -= moved;
+    dst->size = moved;
+    queue_retag(dst);
+
+    bool ok = true;
+    if (moved != expect) {
+        report(1, "ERROR: Selected %zu elements, expected %zu", moved, expect);
+        ok = false;
+    }
+
+    /* The selection is sorted, and no remaining element should precede it */
+    const char *last = NULL;
+    element_t *item;
+    list_for_each_entry (item, dst->q, list) {
+        int r = last ? strcmp(last, item->value) : 0;
+        if ((descend && r < 0) || (!descend && r > 0)) {
+            report(1, "ERROR: Selected elements are not sorted");
+            ok = false;
+            break;
+        }
+        last = item->value;
+    }
+    if (ok && last) {
+        list_for_each_entry (item, src->q, list) {
+            int r = strcmp(item->value, last);
+            if ((descend && r > 0) || (!descend && r < 0)) {
+                report(1, "ERROR: %s should have been selected before %s",
+                       item->value, last);
+                ok = false;
+                break;
+            }
+        }
+    }
+    if (ok)
+        queue_sorted(dst, descend);
+
+    report(2, "Moved %zu elements into queue %d", moved, dst->id);
+    q_show(3);
+    return ok && !error_check();
+}
+
+static bool do_nth(int argc, char *argv[])
+{
+    size_t k = 0;
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    if (!get_size(argv[1], &k)) {
+        report(1, "Invalid rank '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling nth on null queue");
+        return false;
+    }
+    error_check();
+
+    if (k >= current->size) {
+        report(1, "ERROR: Rank %zu is out of range for queue of size %zu", k,
+               current->size);
+        return false;
+    }
+
+    element_t *e = NULL;
+    queue_reordered(current);
+    set_noallocate_mode(true);
+    if (exception_setup(true))
+        e = q_nth(current->q, k, descend);
+    exception_cancel();
+    set_noallocate_mode(false);
+
+    if (!e) {
+        report(1, "ERROR: Failed to select element of rank %zu", k);
+        return false;
+    }
+
+    /* Exactly k elements may precede e, counting equal ones as needed */
+    size_t n_before = 0, n_equal = 0;
+    element_t *item;
+    list_for_each_entry (item, current->q, list) {
+        int r = strcmp(item->value, e->value);
+        if (descend ? r > 0 : r < 0)
+            n_before++;
+        else if (!r)
+            n_equal++;
+    }
+    if (n_before > k || n_before + n_equal <= k) {
+        report(1, "ERROR: %s has rank %zu, not %zu", e->value, n_before, k);
+        return false;
+    }
+
+    report(1, "Element of rank %zu = %s", k, e->value);
+    q_show(3);
+    return !error_check();
+}
+
+/* Number of groups shown by groupby when no count is given */
+#define GROUPBY_TOP 10
+
+static bool do_groupby(int argc, char *argv[])
+{
+    size_t ntop = GROUPBY_TOP;
+    int rewrite = 0;
+    if (argc > 3) {
+        report(1, "%s takes at most 2 arguments", argv[0]);
+        return false;
+    }
+
+    if (argc > 1 && !get_size(argv[1], &ntop)) {
+        report(1, "Invalid number of groups '%s'", argv[1]);
+        return false;
+    }
+    if (argc > 2 && !get_int(argv[2], &rewrite)) {
+        report(1, "Invalid rewrite flag '%s'", argv[2]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling groupby on null queue");
+        return false;
+    }
+    error_check();
+
+    q_group_t *top = malloc((ntop ? ntop : 1) * sizeof(q_group_t));
+    if (!top) {
+        report(1, "ERROR: Could not allocate %zu groups", ntop);
+        return false;
+    }
+
+    /* Deleting duplicates keeps the order, but not the nodes indexed */
+    if (rewrite) {
+        queue_drop_index(current);
+        queue_drop_tree(current);
+        queue_drop_filter(current);
+    }
+
+    ssize_t distinct = -1;
+    if (exception_setup(true))
+        distinct = q_groupby(current->q, top, ntop, rewrite);
+    exception_cancel();
+
+    bool ok = true;
+    if (distinct < 0) {
+        report(1, "ERROR: Failed to count groups");
+        ok = false;
+    }
+
+    if (rewrite) {
+        size_t cnt = 0;
+        struct list_head *cur;
+        list_for_each (cur, current->q)
+            cnt++;
+        current->size = cnt;
+        if (ok && cnt != (size_t) distinct) {
+            report(1,
+                   "ERROR: Queue has %zu elements after rewrite, expected %zd",
+                   cnt, distinct);
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        size_t shown = ntop < (size_t) distinct ? ntop : (size_t) distinct;
+        report(1, "Distinct values: %zd", distinct);
+        for (size_t i = 0; i < shown; i++)
+            report(1, "%8zu %s", top[i].count, top[i].first->value);
+    }
+    free(top);
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+static bool do_at(int argc, char *argv[])
+{
+    size_t i = 0;
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    if (!get_size(argv[1], &i)) {
+        report(1, "Invalid index '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling at on null queue");
+        return false;
+    }
+    error_check();
+
+    if (i >= current->size) {
+        report(1, "ERROR: Index %zu is out of range for queue of size %zu", i,
+               current->size);
+        return false;
+    }
+
+    if (!queue_tree(current)) {
+        report(1, "INTERNAL ERROR.  Could not build order-statistics tree");
+        return false;
+    }
+
+    element_t *e = list_entry(ost_at(current->tree, i), element_t, list);
+    report(1, "Element %zu = %s", i, e->value);
+    return !error_check();
+}
+
+/* Default number of strings sampled to train the symbol table */
+#define COMPRESS_SAMPLE 16384
+
+static bool do_compress(int argc, char *argv[])
+{
+    int sample = COMPRESS_SAMPLE;
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    if (argc == 2 && (!get_int(argv[1], &sample) || sample <= 0)) {
+        report(1, "Invalid sample size '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->q || list_empty(current->q)) {
+        report(3, "Warning: Calling compress on null or empty queue");
+        return false;
+    }
+    error_check();
+
+    size_t n = 0, raw_bytes = 0, max_len = 0;
+    element_t *item;
+    list_for_each_entry (item, current->q, list) {
+        size_t len = strlen(item->value);
+        raw_bytes += len + 1;
+        if (len > max_len)
+            max_len = len;
+        n++;
+    }
+
+    /* Sample evenly across the queue rather than from its head only */
+    size_t stride = n > (size_t) sample ? n / sample : 1;
+    size_t n_samples = 0;
+    const char **samples = malloc(((n + stride - 1) / stride) * sizeof(char *));
+    fsst_table_t *table = malloc(sizeof(fsst_table_t));
+    size_t *offsets = malloc((n + 1) * sizeof(size_t));
+    uint8_t *codes = malloc(2 * raw_bytes);
+    char *buf_a = malloc(FSST_SYMBOL_LEN * 2 * max_len + 1);
+    char *buf_b = malloc(FSST_SYMBOL_LEN * 2 * max_len + 1);
+    bool ok = samples && table && offsets && codes && buf_a && buf_b;
+    if (!ok) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for compression");
+        goto out;
+    }
+
+    size_t i = 0;
+    list_for_each_entry (item, current->q, list) {
+        if (i++ % stride == 0)
+            samples[n_samples++] = item->value;
+    }
+
+    double timer;
+    init_time(&timer);
+    if (!fsst_train(table, samples, n_samples)) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for training");
+        ok = false;
+        goto out;
+    }
+    double train_time = delta_time(&timer);
+
+    i = 0;
+    offsets[0] = 0;
+    list_for_each_entry (item, current->q, list) {
+        offsets[i + 1] = offsets[i] + fsst_encode(table, item->value,
+                                                  codes + offsets[i]);
+        i++;
+    }
+    double encode_time = delta_time(&timer);
+
+    size_t decoded = 0;
+    for (i = 0; i < n; i++)
+        decoded += fsst_decode(table, codes + offsets[i],
+                               offsets[i + 1] - offsets[i], buf_a);
+    double decode_time = delta_time(&timer);
+
+    /* Adjacent comparisons, as a merge pass would perform them */
+    int sign = 0;
+    struct list_head *cur;
+    list_for_each (cur, current->q) {
+        if (cur->next == current->q)
+            break;
+        sign += strcmp(list_entry(cur, element_t, list)->value,
+                       list_entry(cur->next, element_t, list)->value) < 0;
+    }
+    double raw_cmp_time = delta_time(&timer);
+
+    int csign = 0;
+    for (i = 0; i + 1 < n; i++) {
+        fsst_decode(table, codes + offsets[i], offsets[i + 1] - offsets[i],
+                    buf_a);
+        fsst_decode(table, codes + offsets[i + 1],
+                    offsets[i + 2] - offsets[i + 1], buf_b);
+        csign += strcmp(buf_a, buf_b) < 0;
+    }
+    double cmp_time = delta_time(&timer);
+
+    /* Round trip must reproduce every string exactly */
+    i = 0;
+    list_for_each_entry (item, current->q, list) {
+        fsst_decode(table, codes + offsets[i], offsets[i + 1] - offsets[i],
+                    buf_a);
+        if (strcmp(buf_a, item->value)) {
+            report(1, "ERROR: Compressed string \"%s\" decodes to \"%s\"",
+                   item->value, buf_a);
+            ok = false;
+            break;
+        }
+        i++;
+    }
+    if (ok && (sign != csign || decoded + n != raw_bytes)) {
+        report(1, "ERROR: Comparisons on decompressed strings disagree");
+        ok = false;
+    }
+
+    /* Each compressed string also needs its length, one byte in practice */
+    size_t packed_bytes = offsets[n] + n + sizeof(fsst_table_t);
+    report(1, "Symbol table: %u symbols learned from %zu strings in %.3f s",
+           table->n_symbols, n_samples, train_time);
+    report(1, "Raw:        %zu bytes in %zu strings (%.2f bytes/string)",
+           raw_bytes, n, (double) raw_bytes / n);
+    report(1, "Compressed: %zu bytes (%.2f bytes/string, ratio %.2fx)",
+           packed_bytes, (double) packed_bytes / n,
+           (double) raw_bytes / packed_bytes);
+    report(1, "Encode: %.3f s (%.1f MB/s), decode: %.3f s (%.1f MB/s)",
+           encode_time, raw_bytes / (encode_time + 1e-9) / 1e6, decode_time,
+           raw_bytes / (decode_time + 1e-9) / 1e6);
+    report(1, "Adjacent compare: raw %.3f s, decompressed %.3f s",
+           raw_cmp_time, cmp_time);
+
+out:
+    free(samples);
+    free(table);
+    free(offsets);
+    free(codes);
+    free(buf_a);
+    free(buf_b);
+    return ok && !error_check();
+}
+
+static bool is_circular()
+{
+    struct list_head *cur = current->q->next;
+    struct list_head *fast = (cur) ? cur->next : NULL;
+    while (cur != current->q) {
+        if (!cur || !fast || !fast->next)
+            return false;
+        if (cur == fast)
+            return false;
+        cur = cur->next;
+        fast = fast->next->next;
+    }
+
+    cur = current->q->prev;
+    fast = (cur) ? cur->prev : NULL;
+    while (cur != current->q) {
+        if (!cur || !fast || !fast->prev)
+            return false;
+        cur = cur->prev;
+        fast = fast->prev->prev;
+    }
+    return true;
+}
+
+static bool q_show(int vlevel)
+{
+    bool ok = true;
+    if (verblevel < vlevel)
+        return true;
+
+    size_t cnt = 0;
+    if (!current || !current->q) {
+        report(vlevel, "l = NULL");
+        return true;
+    }
+
+    if (!is_circular()) {
+        report(vlevel, "ERROR:  Queue is not doubly circular");
+        return false;
+    }
+
+    report_noreturn(vlevel, "l = [");
+
+    struct list_head *ori = current->q;
+    struct list_head *cur = current->q->next;
+    struct list_head *ahead = list_prefetch_start(cur, ori);
+
+    if (exception_setup(true)) {
+        while (ok && ori != cur && cnt < current->size) {
+            element_t *e = list_entry(cur, element_t, list);
+            ahead = list_prefetch_next(ahead, ori);
+            if (cnt < BIG_LIST_SIZE) {
+                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
+                if (show_entropy) {
+                    report_noreturn(
+                        vlevel, "(%3.2f%%)",
+                        shannon_entropy((const uint8_t *) e->value));
+                }
+            }
+            cnt++;
+            cur = cur->next;
+            ok = ok && !error_check();
+        }
+    }
+    exception_cancel();
+
+    if (!ok) {
+        report(vlevel, " ... ]");
+        return false;
+    }
+
+    if (cur == ori) {
+        if (cnt <= BIG_LIST_SIZE)
+            report(vlevel, "]");
+        else
+            report(vlevel, " ... ]");
+    } else {
+        report(vlevel, " ... ]");
+        report(vlevel, "ERROR:  Queue has more than %zu elements",
+               current->size);
+        ok = false;
+    }
+
+    return ok;
+}
+
+/* Queue of integers generated by DECLARE_QUEUE, to compare against the
+ * string queue. There is a single numeric queue, outside the chain.
+ */
+static inline int num_cmp(long a, long b)
+{
+    return (a > b) - (a < b);
+}
+
+DECLARE_QUEUE(numq, long, num_cmp)
+
+/* Random numbers are drawn from [0, NUM_RAND_RANGE) */
+#define NUM_RAND_RANGE 1000000000
+
+static struct list_head *num_queue = NULL;
+static size_t num_size = 0;
+
+static void num_show(int vlevel)
+{
+    if (verblevel < vlevel)
+        return;
+
+    if (!num_queue) {
+        report(vlevel, "n = NULL");
+        return;
+    }
+
+    int cnt = 0;
+    struct list_head *node;
+    report_noreturn(vlevel, "n = [");
+    list_for_each (node, num_queue) {
+        if (cnt == BIG_LIST_SIZE) {
+            report_noreturn(vlevel, " ...");
+            break;
+        }
+        report_noreturn(vlevel, cnt ? " %ld" : "%ld", numq_value(node));
+        cnt++;
+    }
+    report(vlevel, "]");
+}
+
+static bool num_insert(position_t pos, int argc, char *argv[])
+{
+    int value = 0;
+    size_t reps = 1;
+    bool need_rand = false;
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+
+    if (!strcmp(argv[1], "RAND")) {
+        need_rand = true;
+    } else if (!get_int(argv[1], &value)) {
+        report(1, "Invalid number '%s'", argv[1]);
+        return false;
+    }
+    if (argc == 3 && !get_size(argv[2], &reps)) {
+        report(1, "Invalid number of insertions '%s'", argv[2]);
+        return false;
+    }
+
+    if (!num_queue && !(num_queue = numq_new())) {
+        report(1, "ERROR: Could not allocate numeric queue");
+        return false;
+    }
+
+    bool ok = true;
+    if (exception_setup(true)) {
+        for (size_t r = 0; ok && r < reps; r++) {
+            long v = value;
+            if (need_rand)
+                v = rand() % NUM_RAND_RANGE;
+            ok = pos == POS_TAIL ? numq_insert_tail(num_queue, v)
+                                 : numq_insert_head(num_queue, v);
+            if (ok)
+                num_size++;
+        }
+    }
+    exception_cancel();
+
+    if (!ok)
+        report(1, "ERROR: Insertion into numeric queue failed");
+    num_show(3);
+    return ok && !error_check();
+}
+
+static bool do_ihn(int argc, char *argv[])
+{
+    return num_insert(POS_HEAD, argc, argv);
+}
+
+static bool do_itn(int argc, char *argv[])
+{
+    return num_insert(POS_TAIL, argc, argv);
+}
+
+static bool do_rhn(int argc, char *argv[])
+{
+    long value;
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!num_queue || !numq_remove_head(num_queue, &value)) {
+        report(1, "ERROR: Removal from numeric queue failed");
+        return false;
+    }
+    num_size--;
+
+    report(2, "Removed %ld from numeric queue", value);
+    num_show(3);
+    return !error_check();
+}
+
+static bool do_sortn(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!num_queue) {
+        report(3, "Warning: Calling sortn on null numeric queue");
+        return false;
+    }
+    error_check();
+
+    if (exception_setup(true))
+        numq_sort(num_queue, descend);
+    exception_cancel();
+
+    bool ok = numq_size(num_queue) == num_size;
+    struct list_head *node;
+    list_for_each (node, num_queue) {
+        if (!ok || node->next == num_queue)
+            break;
+        int r = num_cmp(numq_value(node), numq_value(node->next));
+        ok = descend ? r >= 0 : r <= 0;
+    }
+    if (!ok)
+        report(1, "ERROR: Numeric queue is not sorted in %s order",
+               descend ? "descending" : "ascending");
+
+    num_show(3);
+    return ok && !error_check();
+}
+
+static bool do_freen(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    numq_free(num_queue);
+    num_queue = NULL;
+    num_size = 0;
+    num_show(3);
+    return !error_check();
+}
+
+static bool do_show(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (current)
+        report(1, "Current queue ID: %d", current->id);
+
+    return q_show(0);
+}
+
+static bool do_prev(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!current) {
+        report(3, "Warning: Try to operate null queue");
+        return false;
+    }
+
+    struct list_head *prev;
+    if (chain.size > 1) {
+        prev = ((uintptr_t) chain.head.next == (uintptr_t) &current->chain)
+                   ? chain.head.prev
+                   : current->chain.prev;
+        queue_select(prev ? list_entry(prev, queue_contex_t, chain) : NULL);
+    }
+
+    return q_show(0);
+}
+
+static bool do_next(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!current) {
+        report(3, "Warning: Try to operate null queue");
+        return false;
+    }
+
+    struct list_head *next;
+    if (chain.size > 1) {
+        next = ((uintptr_t) chain.head.prev == (uintptr_t) &current->chain)
+                   ? chain.head.next
+                   : current->chain.next;
+        queue_select(next ? list_entry(next, queue_contex_t, chain) : NULL);
+    }
 
     return q_show(0);
 }
@@ -1096,24 +2745,174 @@ static void console_init()
                 "");
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
+    ADD_COMMAND(union,
+                "Move the values of queue id missing from current queue into "
+                "it, and delete the rest of queue id",
+                "id");
+    ADD_COMMAND(intersect,
+                "Keep the elements of current queue whose value is in queue id",
+                "id");
+    ADD_COMMAND(diff,
+                "Delete the elements of current queue whose value is in queue "
+                "id",
+                "id");
+    ADD_COMMAND(split,
+                "Move the first k elements of current queue into a new queue",
+                "k");
+    ADD_COMMAND(rotate,
+                "Move the first k elements to the end, or the last -k "
+                "elements to the front",
+                "[k]");
+    ADD_COMMAND(concat, "Append all elements of queue id to current queue",
+                "id");
+    ADD_COMMAND(defrag,
+                "Copy elements into memory allocated in queue order, so that "
+                "consecutive nodes are adjacent",
+                "");
+    ADD_COMMAND(locality,
+                "Show average address distance between consecutive nodes", "");
+    ADD_COMMAND(arena,
+                "Show memory of huge page arenas and their huge page coverage",
+                "");
+    ADD_COMMAND(fault,
+                "Fail allocations at every nth call, at the given calls, or "
+                "with probability p percent, at the call sites matching "
+                "site; show calls and failures per site without arguments",
+                "[off | every n | at n1 n2 ... | random p] [site]");
+    ADD_COMMAND(leaks,
+                "Show the allocation sites and call stacks holding the most "
+                "memory",
+                "");
+    ADD_COMMAND(threads,
+                "Allocate, resize and free blocks at random from t threads, "
+                "n times each, and check that none is lost",
+                "t n");
+    ADD_COMMAND(mem,
+                "Show the memory of each queue, its peak, allocations, ratio "
+                "of total to payload bytes and bytes per element",
+                "");
+    ADD_COMMAND(memstats,
+                "Show live and peak bytes by power-of-two size class, with "
+                "rates since the last memstats; write them as CSV to file if "
+                "given",
+                "[file]");
+    ADD_COMMAND(ihn,
+                "Insert number n at head of numeric queue (n random if RAND), "
+                "k times",
+                "n [k]");
+    ADD_COMMAND(itn,
+                "Insert number n at tail of numeric queue (n random if RAND), "
+                "k times",
+                "n [k]");
+    ADD_COMMAND(rhn, "Remove from head of numeric queue", "");
+    ADD_COMMAND(sortn, "Sort numeric queue in ascending/descending order", "");
+    ADD_COMMAND(freen, "Delete numeric queue", "");
+    ADD_COMMAND(contains,
+                "Check whether str may be in queue using its Bloom filter",
+                "str");
+    ADD_COMMAND(find,
+                "Search sorted queue for str using its index, or scan an "
+                "unsorted queue",
+                "str");
+    ADD_COMMAND(is, "Insert str at its position in sorted queue", "str");
+    ADD_COMMAND(topk,
+                "Move the k smallest (largest with option descend) elements "
+                "into a new queue, in sorted order",
+                "k");
+    ADD_COMMAND(nth,
+                "Show the element of 0-based rank k in ascending/descending "
+                "order, without sorting",
+                "k");
+    ADD_COMMAND(groupby,
+                "Count elements of each distinct value, show the n largest "
+                "groups, and keep one element per group if rewrite is 1",
+                "[n] [rewrite]");
+    ADD_COMMAND(at, "Show element at 0-based index i of queue", "i");
+    ADD_COMMAND(compress,
+                "Report memory and throughput of symbol-table compression of "
+                "a copy of queue strings, trained on a sample of the queue",
+                "[sample]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("faultseed", &fault_seed,
+              "Seed of the pseudo-random allocation failures", NULL);
+    add_param("stacks", &stack_sample,
+              "Record the call stack of 1 in n allocations, of all if 1, of "
+              "none if 0",
+              NULL);
+    add_param("poison", &poison_sample,
+              "Fill 1 in n allocated and freed payloads with a pattern, all "
+              "if 1, none if 0",
+              NULL);
+    add_param("quarantine", &quarantine_size,
+              "Number of freed blocks held back to detect use after free",
+              NULL);
+    add_param("guard", &guard_size,
+              "Place blocks of at least n bytes against an inaccessible page, "
+              "0 to disable",
+              NULL);
+    add_param("timelimit", &time_limit,
+              "Seconds allowed for each timed queue operation", NULL);
+    add_param("arena", &arena_mode,
+              "Allocate queue elements from huge page arenas", NULL);
+    add_param("compact", &compact_mode,
+              "Keep allocation metadata in a side table instead of block "
+              "headers",
+              NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("sortkey", &sort_key,
+              "Order of sort: 0 strcmp, 1 natural, 2 ignoring case, 3 length "
+              "first",
+              NULL);
+    add_param("ostree", &use_ostree,
+              "Serve dm from the order-statistics tree, and keep the tree "
+              "through reverseK",
+              NULL);
 }
 
 /* Signal handlers */
-static void sigsegv_handler(int sig)
+/* Write a string, or a number in decimal, from a signal handler */
+static void write_str(const char *s)
+{
+    size_t len = strlen(s);
+    assert(write(1, s, len) == (ssize_t) len);
+}
+
+static void write_size(size_t n)
+{
+    char buf[24], *p = buf + sizeof(buf);
+    *--p = '\0';
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    write_str(p);
+}
+
+static void sigsegv_handler(int sig, siginfo_t *info, void *context)
 {
     /* Avoid possible non-reentrant signal function be used in signal handler */
-    assert(write(1,
-                 "Segmentation fault occurred.  You dereferenced a NULL or "
-                 "invalid pointer",
-                 73) == 73);
+    size_t size;
+    const char *site;
+    unsigned char *block = guard_block(info->si_addr, &size, &site);
+    if (block) {
+        write_str("Segmentation fault occurred.  You accessed offset ");
+        write_size((unsigned char *) info->si_addr - block);
+        write_str(" of a block of ");
+        write_size(size);
+        write_str(" bytes allocated at ");
+        write_str(site);
+        write_str("\n");
+    } else {
+        write_str(
+            "Segmentation fault occurred.  You dereferenced a NULL or "
+            "invalid pointer");
+    }
     /* Raising a SIGABRT signal to produce a core dump for debugging. */
     abort();
 }
@@ -1129,21 +2928,28 @@ static void q_init()
 {
     fail_count = 0;
     INIT_LIST_HEAD(&chain.head);
-    signal(SIGSEGV, sigsegv_handler);
+    init_time(&memstats_time);
+    struct sigaction sa = {
+        .sa_sigaction = sigsegv_handler,
+        .sa_flags = SA_SIGINFO,
+    };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
     signal(SIGALRM, sigalrm_handler);
 }
 
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
 
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
         while (chain.size > 0) {
             queue_contex_t *qctx = list_entry(cur, queue_contex_t, chain);
             cur = cur->next;
+            q_index_free(&qctx->index);
+            queue_drop_tree(qctx);
+            queue_drop_filter(qctx);
             q_free(qctx->q);
             free(qctx);
             chain.size--;
@@ -1151,12 +2957,15 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
+
+    numq_free(num_queue);
+    num_queue = NULL;
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
         report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
                bcnt);
+        show_leaks();
         return false;
     }
 
@@ -1,3 +1,5 @@
+#include <ctype.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,7 +23,8 @@ void q_free(struct list_head *l)
         return;
 
     element_t *entry, *safe;
-    list_for_each_entry_safe (entry, safe, l, list) {
+    struct list_head *ahead;
+    list_for_each_entry_safe_prefetch (entry, safe, ahead, l, list, value) {
         free(entry->value);
         free(entry);
     }
@@ -107,14 +110,14 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 }
 
 /* Return number of elements in queue */
-int q_size(struct list_head *head)
+size_t q_size(struct list_head *head)
 {
     if (!head)
         return 0;
 
-    int count = 0;
-    struct list_head *node;
-    list_for_each (node, head)
+    size_t count = 0;
+    struct list_head *node, *ahead;
+    list_for_each_prefetch (node, ahead, head)
         count++;
     return count;
 }
@@ -198,59 +201,201 @@ void q_reverse(struct list_head *head)
         prev = cur;
         cur = next;
     }
+    head->prev = head->next;
     head->next = prev;
-    prev->prev = head;
+}
+
+/* Order two elements for list_sort(), priv pointing to the descend flag */
+static int q_sort_cmp(void *priv,
+                      const struct list_head *a,
+                      const struct list_head *b)
+{
+    int r = strcmp(list_entry(a, element_t, list)->value,
+                   list_entry(b, element_t, list)->value);
+    return *(const bool *) priv ? -r : r;
 }
 
 /* Sort elements of queue in ascending order or descending order */
 void q_sort(struct list_head *head, bool descend)
 {
-    if (!head || list_empty(head))
+    if (!head)
         return;
+    list_sort(&descend, head, q_sort_cmp);
+}
+
+/* The value itself, as compared by q_sort() */
+bool q_key_plain(const char *value, q_key_t *key)
+{
+    key->num = 0;
+    key->str = value;
+    key->buf = NULL;
+    return true;
+}
 
-    struct list_head sorted;
-    INIT_LIST_HEAD(&sorted);
+/* Length markers of digit runs are control characters, below any character
+ * expected in a value. A run of n significant digits, n = 30q + r, is marked
+ * by q bytes of value 31 and a byte of value r + 1, so that markers compare
+ * like the lengths, and runs of equal length compare like their digits.
+ */
+#define Q_RUN_MARK_MAX 31
 
-    struct list_head *node, *next;
-    list_for_each_safe (node, next, head) {
-        list_del(node);
-        struct list_head *pos;
-        list_for_each (pos, &sorted) {
-            element_t *a = list_entry(node, element_t, list);
-            element_t *b = list_entry(pos, element_t, list);
-            if ((descend && strcmp(a->value, b->value) > 0) ||
-                (!descend && strcmp(a->value, b->value) < 0)) {
-                break;
-            }
+/* The value with each run of digits prefixed by its significant length */
+bool q_key_natural(const char *value, q_key_t *key)
+{
+    char *out = malloc(2 * strlen(value) + 1);
+    if (!out)
+        return false;
+
+    key->num = 0;
+    key->str = key->buf = out;
+    while (*value) {
+        if (!isdigit((unsigned char) *value)) {
+            *out++ = *value++;
+            continue;
         }
-        list_add_tail(node, pos);
+        const char *run = value;
+        while (*run == '0' && isdigit((unsigned char) run[1]))
+            run++;
+        for (value = run; isdigit((unsigned char) *value);)
+            value++;
+
+        size_t n = value - run;
+        for (; n >= Q_RUN_MARK_MAX - 1; n -= Q_RUN_MARK_MAX - 1)
+            *out++ = Q_RUN_MARK_MAX;
+        *out++ = n + 1;
+        memcpy(out, run, value - run);
+        out += value - run;
     }
+    *out = '\0';
+    return true;
+}
+
+/* The value in lower case */
+bool q_key_nocase(const char *value, q_key_t *key)
+{
+    size_t len = strlen(value);
+    char *out = malloc(len + 1);
+    if (!out)
+        return false;
 
-    list_splice(&sorted, head);
+    for (size_t i = 0; i <= len; i++)
+        out[i] = tolower((unsigned char) value[i]);
+    key->num = 0;
+    key->str = key->buf = out;
+    return true;
 }
 
-/* Reverse the first k elements of queue */
-void q_reverseK(struct list_head *head, int k)
+/* The length of the value, then the value */
+bool q_key_length(const char *value, q_key_t *key)
 {
-    if (!head || list_empty(head) || k <= 0)
-        return;
+    key->num = strlen(value);
+    key->str = value;
+    key->buf = NULL;
+    return true;
+}
 
-    struct list_head *cur = head->next;
-    struct list_head temp_head;
-    INIT_LIST_HEAD(&temp_head);
+int q_key_cmp(const q_key_t *a, const q_key_t *b)
+{
+    if (a->num != b->num)
+        return a->num < b->num ? -1 : 1;
+    return strcmp(a->str, b->str);
+}
 
-    for (int i = 0; i < k && cur != head; i++) {
-        struct list_head *next = cur->next;
-        list_del(cur);
-        list_add(cur, &temp_head);
-        cur = next;
+void q_key_release(q_key_t *key)
+{
+    free(key->buf);
+    key->buf = NULL;
+}
+
+/* Key of an element, linked in a list of keys to sort */
+typedef struct {
+    q_key_t key;
+    struct list_head *node;
+    struct list_head link;
+} q_keyed_t;
+
+typedef struct {
+    q_key_cmp_fn cmp;
+    bool descend;
+} q_keyed_order_t;
+
+static int q_keyed_cmp(void *priv,
+                       const struct list_head *a,
+                       const struct list_head *b)
+{
+    const q_keyed_order_t *order = priv;
+    int r = order->cmp(&list_entry(a, q_keyed_t, link)->key,
+                       &list_entry(b, q_keyed_t, link)->key);
+    return order->descend ? -r : r;
+}
+
+/* Sort elements of queue by a key computed once per element */
+bool q_sort_by(struct list_head *head,
+               q_key_cmp_fn cmp,
+               q_key_fn key_fn,
+               bool descend)
+{
+    if (!head || list_empty(head))
+        return true;
+
+    size_t n = q_size(head), i = 0;
+    q_keyed_t *keyed = malloc(n * sizeof(q_keyed_t));
+    bool ok = keyed;
+
+    LIST_HEAD(keys);
+    element_t *entry;
+    struct list_head *ahead;
+    list_for_each_entry_prefetch (entry, ahead, head, list, value) {
+        if (!ok || !key_fn(entry->value, &keyed[i].key)) {
+            ok = false;
+            break;
+        }
+        keyed[i].node = &entry->list;
+        list_add_tail(&keyed[i].link, &keys);
+        i++;
     }
 
-    list_splice_tail(&temp_head, head);
+    if (ok) {
+        q_keyed_order_t order = {.cmp = cmp, .descend = descend};
+        q_keyed_t *k;
+        list_sort(&order, &keys, q_keyed_cmp);
+        INIT_LIST_HEAD(head);
+        list_for_each_entry (k, &keys, link)
+            list_add_tail(k->node, head);
+    }
+
+    /* Only the first i keys were computed */
+    while (i--)
+        q_key_release(&keyed[i].key);
+    free(keyed);
+    return ok;
+}
+
+/* Reverse each group of k elements, leaving fewer than k at the end as is */
+void q_reverseK(struct list_head *head, size_t k)
+{
+    if (!head || k < 2)
+        return;
+
+    struct list_head *prev = head;
+    for (;;) {
+        struct list_head *last = prev;
+        for (size_t n = 0; n < k; n++) {
+            last = last->next;
+            if (last == head)
+                return;
+        }
+
+        /* Move each following node of the group to its front */
+        struct list_head *first = prev->next;
+        for (size_t i = 1; i < k; i++)
+            list_move(first->next, prev);
+        prev = first;
+    }
 }
 
 /* Descend the queue */
-int q_descend(struct list_head *head)
+size_t q_descend(struct list_head *head)
 {
     if (!head)
         return 0;
@@ -260,7 +405,7 @@ int q_descend(struct list_head *head)
 }
 
 /* Ascend the queue */
-int q_ascend(struct list_head *head)
+size_t q_ascend(struct list_head *head)
 {
     if (!head)
         return 0;
@@ -270,7 +415,7 @@ int q_ascend(struct list_head *head)
 }
 
 /* Merge all the queues into one sorted queue */
-int q_merge(struct list_head *head, bool descend)
+size_t q_merge(struct list_head *head, bool descend)
 {
     if (!head)
         return 0;
@@ -293,3 +438,803 @@ int q_merge(struct list_head *head, bool descend)
 
     return q_size(&merged_head);
 }
+
+/* Move the first k elements of a queue to the end of another one */
+size_t q_split(struct list_head *head, size_t k, struct list_head *dst)
+{
+    if (!head || !dst || !k)
+        return 0;
+
+    size_t moved = 0;
+    struct list_head *node = head;
+    while (moved < k && node->next != head) {
+        node = node->next;
+        moved++;
+    }
+
+    LIST_HEAD(cut);
+    list_cut_position(&cut, head, node);
+    list_splice_tail(&cut, dst);
+    return moved;
+}
+
+/* Move the first k elements to the end, or the last -k to the front */
+void q_rotate(struct list_head *head, ssize_t k)
+{
+    if (!head || list_empty(head) || !k)
+        return;
+
+    bool forward = k > 0;
+    size_t steps = forward ? (size_t) k : -(size_t) k;
+    size_t i;
+    struct list_head *node = head;
+    for (i = 0; i < steps && (forward ? node->next : node->prev) != head; i++)
+        node = forward ? node->next : node->prev;
+
+    /* All i elements were passed, so only the remainder of steps matters */
+    if (i < steps) {
+        steps %= i;
+        node = head;
+        for (i = 0; i < steps; i++)
+            node = forward ? node->next : node->prev;
+    }
+
+    /* The elements up to the cutting point go behind the others */
+    LIST_HEAD(cut);
+    list_cut_position(&cut, head, forward ? node : node->prev);
+    list_splice_tail(&cut, head);
+}
+
+/* Append all elements of src to dst */
+void q_concat(struct list_head *dst, struct list_head *src)
+{
+    if (!dst || !src || dst == src)
+        return;
+    list_splice_tail_init(src, dst);
+}
+
+/* Replace each element by a copy allocated in list order */
+bool q_defrag(struct list_head *head)
+{
+    if (!head)
+        return false;
+
+    element_t *entry, *safe;
+    struct list_head *ahead;
+    list_for_each_entry_safe_prefetch (entry, safe, ahead, head, list, value) {
+        size_t len = strlen(entry->value) + 1;
+        element_t *copy = malloc(sizeof(element_t));
+        char *value = copy ? malloc(len) : NULL;
+        if (!value) {
+            free(copy);
+            return false;
+        }
+        copy->value = memcpy(value, entry->value, len);
+        list_add(&copy->list, &entry->list);
+        list_del(&entry->list);
+        q_release_element(entry);
+    }
+    return true;
+}
+
+/* Build the search index of a sorted queue */
+bool q_index_build(struct list_head *head, q_index_t *idx, bool descend)
+{
+    q_index_free(idx);
+    idx->descend = descend;
+    if (!head || list_empty(head))
+        return true;
+
+    size_t n = q_size(head);
+    size_t cap = (n + Q_INDEX_STRIDE - 1) / Q_INDEX_STRIDE;
+    idx->slot = malloc(cap * sizeof(struct list_head *));
+    if (!idx->slot)
+        return false;
+    idx->cap = cap;
+
+    size_t i = 0;
+    struct list_head *node, *ahead;
+    list_for_each_prefetch (node, ahead, head) {
+        if (i++ % Q_INDEX_STRIDE == 0)
+            idx->slot[idx->count++] = node;
+    }
+    return true;
+}
+
+/* Release the storage of a search index */
+void q_index_free(q_index_t *idx)
+{
+    free(idx->slot);
+    idx->slot = NULL;
+    idx->count = 0;
+    idx->cap = 0;
+}
+
+/* Compare two strings in the order the indexed queue is sorted */
+static inline int q_index_cmp(const q_index_t *idx,
+                              const char *a,
+                              const char *b)
+{
+    int r = strcmp(a, b);
+    return idx->descend ? -r : r;
+}
+
+/* Find the first node not ordered before s, or the first node ordered after s
+ * if upper is set. Return head if there is no such node, and store in bucket
+ * the number of samples ordered before the node found.
+ */
+static struct list_head *q_index_seek(struct list_head *head,
+                                      const q_index_t *idx,
+                                      const char *s,
+                                      bool upper,
+                                      size_t *bucket)
+{
+    /* Binary search for the last sample still ordered before the target */
+    size_t lo = 0, hi = idx->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int r = q_index_cmp(
+            idx, list_entry(idx->slot[mid], element_t, list)->value, s);
+        if (r < 0 || (upper && r == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (bucket)
+        *bucket = lo;
+    struct list_head *node = lo ? idx->slot[lo - 1] : head->next;
+    while (node != head) {
+        int r =
+            q_index_cmp(idx, list_entry(node, element_t, list)->value, s);
+        if (r > 0 || (!upper && r == 0))
+            break;
+        node = node->next;
+    }
+    return node;
+}
+
+/* Find an element holding the given string */
+element_t *q_find(struct list_head *head, const q_index_t *idx, const char *s)
+{
+    if (!head || !s)
+        return NULL;
+
+    if (!idx) {
+        element_t *entry;
+        list_for_each_entry (entry, head, list) {
+            if (!strcmp(entry->value, s))
+                return entry;
+        }
+        return NULL;
+    }
+
+    struct list_head *node = q_index_seek(head, idx, s, false, NULL);
+    if (node == head)
+        return NULL;
+    element_t *entry = list_entry(node, element_t, list);
+    return strcmp(entry->value, s) ? NULL : entry;
+}
+
+/* Sample the middle of a bucket once inserts made it twice as long as the
+ * stride, so that searches keep walking about Q_INDEX_STRIDE nodes. Bucket b
+ * runs from sample b - 1, or the front of the queue, up to sample b.
+ */
+static void q_index_split(struct list_head *head, q_index_t *idx, size_t b)
+{
+    struct list_head *end = b < idx->count ? idx->slot[b] : head;
+    struct list_head *node = b ? idx->slot[b - 1] : head->next;
+    struct list_head *mid = NULL;
+    for (size_t n = 0; n <= 2 * Q_INDEX_STRIDE; n++, node = node->next) {
+        if (node == end)
+            return;
+        if (n == Q_INDEX_STRIDE)
+            mid = node;
+    }
+
+    if (idx->count == idx->cap) {
+        size_t cap = idx->cap ? 2 * idx->cap : 1;
+        struct list_head **slot =
+            realloc(idx->slot, cap * sizeof(struct list_head *));
+        /* Without room the bucket stays long; searches are only slower */
+        if (!slot)
+            return;
+        idx->slot = slot;
+        idx->cap = cap;
+    }
+    memmove(&idx->slot[b + 1], &idx->slot[b],
+            (idx->count - b) * sizeof(struct list_head *));
+    idx->slot[b] = mid;
+    idx->count++;
+}
+
+/* Insert an element keeping the queue sorted */
+bool q_insert_sorted(struct list_head *head, q_index_t *idx, char *s)
+{
+    if (!head || !idx || !s)
+        return false;
+
+    element_t *new_element = malloc(sizeof(element_t));
+    if (!new_element)
+        return false;
+
+    new_element->value = strdup(s);
+    if (!new_element->value) {
+        free(new_element);
+        return false;
+    }
+
+    size_t b;
+    list_add_tail(&new_element->list, q_index_seek(head, idx, s, true, &b));
+    q_index_split(head, idx, b);
+    return true;
+}
+
+/* Compare two list nodes in the requested order */
+static inline int q_node_cmp(const struct list_head *a,
+                             const struct list_head *b,
+                             bool descend)
+{
+    int r = strcmp(list_entry(a, element_t, list)->value,
+                   list_entry(b, element_t, list)->value);
+    return descend ? -r : r;
+}
+
+/* Pairing heap threaded through list nodes: prev points to the first child
+ * and next to the following sibling. The root is the node ordered last, so
+ * it is the one to evict when a better candidate shows up.
+ */
+static struct list_head *q_heap_meld(struct list_head *a,
+                                     struct list_head *b,
+                                     bool descend)
+{
+    if (!a || !b)
+        return a ? a : b;
+    if (q_node_cmp(a, b, descend) < 0) {
+        struct list_head *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    b->next = a->prev;
+    a->prev = b;
+    return a;
+}
+
+/* Remove the root, return the new root */
+static struct list_head *q_heap_pop(struct list_head *root, bool descend)
+{
+    struct list_head *pairs = NULL, *child = root->prev;
+
+    /* Meld children pairwise from left to right, stacking the results */
+    while (child) {
+        struct list_head *a = child, *b = child->next;
+        child = b ? b->next : NULL;
+        a->next = NULL;
+        if (b)
+            b->next = NULL;
+        struct list_head *m = q_heap_meld(a, b, descend);
+        m->next = pairs;
+        pairs = m;
+    }
+
+    /* Then meld the stacked pairs from right to left */
+    struct list_head *new_root = NULL;
+    while (pairs) {
+        struct list_head *next = pairs->next;
+        pairs->next = NULL;
+        new_root = q_heap_meld(new_root, pairs, descend);
+        pairs = next;
+    }
+    return new_root;
+}
+
+/* Move the k smallest or largest elements into another queue */
+size_t q_topk(struct list_head *head,
+              size_t k,
+              struct list_head *dst,
+              bool descend)
+{
+    if (!head || !dst || !k)
+        return 0;
+
+    struct list_head *root = NULL, *node, *safe;
+    size_t count = 0;
+    list_for_each_safe (node, safe, head) {
+        if (count < k) {
+            list_del(node);
+            node->prev = node->next = NULL;
+            root = q_heap_meld(root, node, descend);
+            count++;
+        } else if (q_node_cmp(node, root, descend) < 0) {
+            /* The evicted root takes the place of the new candidate */
+            struct list_head *evicted = root;
+            root = q_heap_pop(root, descend);
+            list_add(evicted, node);
+            list_del(node);
+            node->prev = node->next = NULL;
+            root = q_heap_meld(root, node, descend);
+        }
+    }
+
+    /* Popping yields the selection from last to first */
+    while (root) {
+        struct list_head *top = root;
+        root = q_heap_pop(root, descend);
+        list_add(top, dst);
+    }
+    return count;
+}
+
+/* Random number below n, which may exceed RAND_MAX */
+static inline size_t q_random(size_t n)
+{
+    size_t r = rand();
+    if (n > RAND_MAX)
+        r = r * ((size_t) RAND_MAX + 1) + rand();
+    return r % n;
+}
+
+/* Find the k-th element in sorted order without sorting */
+element_t *q_nth(struct list_head *head, size_t k, bool descend)
+{
+    if (!head)
+        return NULL;
+
+    size_t n = q_size(head);
+    if (k >= n)
+        return NULL;
+
+    LIST_HEAD(before);
+    LIST_HEAD(after);
+    LIST_HEAD(work);
+    list_splice_init(head, &work);
+
+    for (;;) {
+        /* Random pivot, moved to the front of the working range */
+        struct list_head *pivot = work.next;
+        for (size_t r = q_random(n); r > 0; r--)
+            pivot = pivot->next;
+        list_move(pivot, &work);
+
+        LIST_HEAD(less);
+        LIST_HEAD(equal);
+        LIST_HEAD(greater);
+        size_t n_less = 0, n_equal = 0;
+        struct list_head *node, *safe;
+        list_for_each_safe (node, safe, &work) {
+            int r = q_node_cmp(node, pivot, descend);
+            if (r < 0) {
+                list_move_tail(node, &less);
+                n_less++;
+            } else if (r == 0) {
+                list_move_tail(node, &equal);
+                n_equal++;
+            } else {
+                list_move_tail(node, &greater);
+            }
+        }
+
+        if (k < n_less) {
+            list_splice(&greater, &after);
+            list_splice(&equal, &after);
+            list_splice(&less, &work);
+            n = n_less;
+        } else if (k < n_less + n_equal) {
+            list_splice_tail(&less, &before);
+            list_splice_tail(&equal, &before);
+            list_splice_tail(&greater, &before);
+            list_splice_tail(&after, &before);
+            list_splice(&before, head);
+            return list_entry(pivot, element_t, list);
+        } else {
+            list_splice_tail(&less, &before);
+            list_splice_tail(&equal, &before);
+            list_splice(&greater, &work);
+            k -= n_less + n_equal;
+            n -= n_less + n_equal;
+        }
+    }
+}
+
+/* 64-bit FNV-1a hash of a string */
+static inline uint64_t q_hash(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Slot of a hash table of strings. An empty slot has no first element */
+typedef struct {
+    element_t *first;
+    uint64_t hash;
+    size_t count;
+} q_group_slot_t;
+
+/* Open-addressing table of the distinct values of a queue, kept at most half
+ * full with linear probing.
+ *
+ * The table holds only the values whose hash lies in [lo, hi], which is every
+ * value unless the table would outgrow Q_STRSET_MAX_SLOTS. The range is then
+ * halved and the values above it dropped, and the caller walks the queue
+ * again for each further range, as returned by q_strset_next().
+ */
+typedef struct {
+    q_group_slot_t *slot;
+    size_t nslots, used;
+    uint64_t lo, hi;
+} q_strset_t;
+
+#define Q_STRSET_INIT_SLOTS 1024
+#define Q_STRSET_MAX_SLOTS (1 << 20)
+
+static bool q_strset_init(q_strset_t *set)
+{
+    set->nslots = Q_STRSET_INIT_SLOTS;
+    set->used = 0;
+    set->lo = 0;
+    set->hi = UINT64_MAX;
+    set->slot = calloc(set->nslots, sizeof(q_group_slot_t));
+    return set->slot;
+}
+
+/* Whether a value with hash h belongs to the current range */
+static inline bool q_strset_holds(const q_strset_t *set, uint64_t h)
+{
+    return h >= set->lo && h <= set->hi;
+}
+
+/* Empty the table for the next range of hashes, as wide as the current one.
+ * Return false once the last range has been done.
+ */
+static bool q_strset_next(q_strset_t *set)
+{
+    if (set->hi == UINT64_MAX)
+        return false;
+
+    uint64_t width = set->hi - set->lo;
+    set->lo = set->hi + 1;
+    set->hi = UINT64_MAX - set->lo <= width ? UINT64_MAX : set->lo + width;
+    memset(set->slot, 0, set->nslots * sizeof(q_group_slot_t));
+    set->used = 0;
+    return true;
+}
+
+/* Halve the range and drop the values above it, rehashing the others in
+ * place. Each entry can only move back towards its home slot, so the sweep
+ * starts after an empty slot and never meets an entry it already moved.
+ */
+static void q_strset_halve(q_strset_t *set)
+{
+    set->hi = set->lo + (set->hi - set->lo) / 2;
+
+    size_t mask = set->nslots - 1, start = 0;
+    while (set->slot[start].first)
+        start++;
+    for (size_t n = 1; n < set->nslots; n++) {
+        q_group_slot_t *from = &set->slot[(start + n) & mask];
+        if (!from->first)
+            continue;
+        q_group_slot_t moved = *from;
+        from->first = NULL;
+        if (moved.hash > set->hi) {
+            set->used--;
+            continue;
+        }
+        size_t j = moved.hash & mask;
+        while (set->slot[j].first)
+            j = (j + 1) & mask;
+        set->slot[j] = moved;
+    }
+}
+
+/* Find the slot holding s, or the empty slot where it belongs */
+static q_group_slot_t *q_strset_find(const q_strset_t *set,
+                                     const char *s,
+                                     uint64_t h)
+{
+    size_t mask = set->nslots - 1, i = h & mask;
+    while (set->slot[i].first &&
+           (set->slot[i].hash != h || strcmp(set->slot[i].first->value, s)))
+        i = (i + 1) & mask;
+    return &set->slot[i];
+}
+
+/* Store e in the empty slot found for it, growing the table when it gets
+ * half full, or narrowing its range once it has reached its largest size.
+ * Slot pointers are invalid afterwards, and e may have been dropped.
+ * Return false if allocation failed.
+ */
+static bool q_strset_add(q_strset_t *set,
+                         q_group_slot_t *slot,
+                         element_t *e,
+                         uint64_t h)
+{
+    slot->first = e;
+    slot->hash = h;
+    slot->count = 1;
+    if (++set->used * 2 <= set->nslots)
+        return true;
+    if (set->nslots >= Q_STRSET_MAX_SLOTS) {
+        while (set->used * 2 > set->nslots && set->hi > set->lo)
+            q_strset_halve(set);
+        if (set->used * 2 <= set->nslots)
+            return true;
+    }
+
+    size_t n = set->nslots * 2;
+    q_group_slot_t *bigger = calloc(n, sizeof(q_group_slot_t));
+    if (!bigger)
+        return false;
+    for (size_t i = 0; i < set->nslots; i++) {
+        if (!set->slot[i].first)
+            continue;
+        size_t j = set->slot[i].hash & (n - 1);
+        while (bigger[j].first)
+            j = (j + 1) & (n - 1);
+        bigger[j] = set->slot[i];
+    }
+    free(set->slot);
+    set->slot = bigger;
+    set->nslots = n;
+    return true;
+}
+
+/* Add the values of a queue in the current range to set.
+ * Return false if allocation failed.
+ */
+static bool q_strset_fill(q_strset_t *set, struct list_head *head)
+{
+    element_t *entry;
+    struct list_head *ahead;
+    list_for_each_entry_prefetch (entry, ahead, head, list, value) {
+        uint64_t h = q_hash(entry->value);
+        if (!q_strset_holds(set, h))
+            continue;
+        q_group_slot_t *slot = q_strset_find(set, entry->value, h);
+        if (!slot->first && !q_strset_add(set, slot, entry, h))
+            return false;
+    }
+    return true;
+}
+
+/* Insert the groups of the table into the bounded result array, most
+ * frequent first. Return the new number of groups in the array.
+ */
+static size_t q_group_rank(const q_strset_t *set,
+                           q_group_t *top,
+                           size_t ntop,
+                           size_t ntaken)
+{
+    for (size_t i = 0; i < set->nslots && ntop > 0; i++) {
+        const q_group_slot_t *g = &set->slot[i];
+        if (!g->first)
+            continue;
+        size_t j = ntaken;
+        while (j > 0) {
+            const q_group_t *t = &top[j - 1];
+            if (t->count > g->count)
+                break;
+            if (t->count == g->count &&
+                strcmp(t->first->value, g->first->value) < 0)
+                break;
+            j--;
+        }
+        if (j == ntop)
+            continue;
+        if (ntaken < ntop)
+            ntaken++;
+        memmove(&top[j + 1], &top[j], (ntaken - j - 1) * sizeof(q_group_t));
+        top[j].first = g->first;
+        top[j].count = g->count;
+    }
+    return ntaken;
+}
+
+/* Count the elements holding each distinct value, one range of hashes at a
+ * time. Duplicates are set aside as they are met, and only freed at the end:
+ * a value dropped from the table is counted again in a later pass, which has
+ * to take in the duplicates set aside before that pass.
+ */
+ssize_t q_groupby(struct list_head *head,
+                  q_group_t *top,
+                  size_t ntop,
+                  bool rewrite)
+{
+    q_strset_t set;
+    if (!head || !q_strset_init(&set))
+        return -1;
+
+    LIST_HEAD(dups);
+    element_t *entry, *safe;
+    size_t distinct = 0, ntaken = 0;
+    bool ok = true;
+    do {
+        struct list_head *last = dups.prev, *ahead;
+        list_for_each_entry_safe_prefetch (entry, safe, ahead, head, list,
+                                           value) {
+            uint64_t h = q_hash(entry->value);
+            if (!q_strset_holds(&set, h))
+                continue;
+            q_group_slot_t *slot = q_strset_find(&set, entry->value, h);
+            if (!slot->first) {
+                if (!q_strset_add(&set, slot, entry, h)) {
+                    ok = false;
+                    break;
+                }
+                continue;
+            }
+            slot->count++;
+            if (rewrite)
+                list_move_tail(&entry->list, &dups);
+        }
+        if (!ok)
+            break;
+
+        /* Only values added to the table this pass can be in range */
+        for (struct list_head *node = dups.next; last != &dups;
+             node = node->next) {
+            entry = list_entry(node, element_t, list);
+            uint64_t h = q_hash(entry->value);
+            if (q_strset_holds(&set, h))
+                q_strset_find(&set, entry->value, h)->count++;
+            if (node == last)
+                break;
+        }
+
+        distinct += set.used;
+        ntaken = q_group_rank(&set, top, ntop, ntaken);
+    } while (q_strset_next(&set));
+
+    list_for_each_entry_safe (entry, safe, &dups, list)
+        q_release_element(entry);
+    free(set.slot);
+    return ok ? (ssize_t) distinct : -1;
+}
+
+/* Whether every element of the queue is in the given order */
+static bool q_in_order(struct list_head *head, bool descend)
+{
+    struct list_head *node, *ahead;
+    list_for_each_prefetch (node, ahead, head) {
+        if (node->next != head && q_node_cmp(node, node->next, descend) > 0)
+            return false;
+    }
+    return true;
+}
+
+/* Order shared by two queues: 1 if both ascend, -1 if both descend, and 0
+ * if they have no order in common.
+ */
+static int q_common_order(struct list_head *a, struct list_head *b)
+{
+    if (q_in_order(a, false) && q_in_order(b, false))
+        return 1;
+    if (q_in_order(a, true) && q_in_order(b, true))
+        return -1;
+    return 0;
+}
+
+/* Delete the elements of head whose value is, or is not, held by other */
+static ssize_t q_filter(struct list_head *head,
+                        struct list_head *other,
+                        bool keep_shared)
+{
+    int order = q_common_order(head, other);
+    element_t *entry, *safe;
+
+    if (order) {
+        /* o is the first element of other not preceding the current element
+         * of head.
+         */
+        struct list_head *o = other->next;
+        list_for_each_entry_safe (entry, safe, head, list) {
+            while (o != other && q_node_cmp(o, &entry->list, order < 0) < 0)
+                o = o->next;
+            bool shared = o != other && !q_node_cmp(o, &entry->list, false);
+            if (shared != keep_shared) {
+                list_del(&entry->list);
+                q_release_element(entry);
+            }
+        }
+        return q_size(head);
+    }
+
+    q_strset_t set;
+    if (!q_strset_init(&set))
+        return -1;
+    do {
+        if (!q_strset_fill(&set, other)) {
+            free(set.slot);
+            return -1;
+        }
+        list_for_each_entry_safe (entry, safe, head, list) {
+            uint64_t h = q_hash(entry->value);
+            if (!q_strset_holds(&set, h))
+                continue;
+            bool shared = q_strset_find(&set, entry->value, h)->first;
+            if (shared != keep_shared) {
+                list_del(&entry->list);
+                q_release_element(entry);
+            }
+        }
+    } while (q_strset_next(&set));
+    free(set.slot);
+    return q_size(head);
+}
+
+/* Keep the values held by both queues */
+ssize_t q_intersect(struct list_head *head, struct list_head *other)
+{
+    if (!head || !other)
+        return -1;
+    return q_filter(head, other, true);
+}
+
+/* Keep the values not held by other */
+ssize_t q_diff(struct list_head *head, struct list_head *other)
+{
+    if (!head || !other)
+        return -1;
+    return q_filter(head, other, false);
+}
+
+/* Move the values missing from head out of other */
+ssize_t q_union(struct list_head *head, struct list_head *other)
+{
+    if (!head || !other)
+        return -1;
+
+    int order = q_common_order(head, other);
+    element_t *entry, *safe;
+
+    if (order) {
+        /* Insert each element of other before the first element of head
+         * not preceding it. An equal value is then either that element or
+         * the one just before it.
+         */
+        struct list_head *pos = head->next;
+        list_for_each_entry_safe (entry, safe, other, list) {
+            while (pos != head && q_node_cmp(pos, &entry->list, order < 0) < 0)
+                pos = pos->next;
+            if ((pos != head && !q_node_cmp(pos, &entry->list, false)) ||
+                (pos->prev != head &&
+                 !q_node_cmp(pos->prev, &entry->list, false))) {
+                list_del(&entry->list);
+                q_release_element(entry);
+            } else {
+                list_move_tail(&entry->list, pos);
+            }
+        }
+        return q_size(head);
+    }
+
+    /* Hash the values of head, then those of other, so that each value is
+     * held by its first element in head, or else in other. Every other
+     * element of other is a duplicate to delete, and what is left is appended.
+     * The table only grows while filling, before any element is deleted.
+     */
+    q_strset_t set;
+    if (!q_strset_init(&set))
+        return -1;
+    do {
+        if (!q_strset_fill(&set, head) || !q_strset_fill(&set, other)) {
+            free(set.slot);
+            return -1;
+        }
+        list_for_each_entry_safe (entry, safe, other, list) {
+            uint64_t h = q_hash(entry->value);
+            if (!q_strset_holds(&set, h) ||
+                q_strset_find(&set, entry->value, h)->first == entry)
+                continue;
+            list_del(&entry->list);
+            q_release_element(entry);
+        }
+    } while (q_strset_next(&set));
+    free(set.slot);
+    list_splice_tail_init(other, head);
+    return q_size(head);
+}
@@ -9,6 +9,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <sys/types.h>
 
 #include "harness.h"
 #include "list.h"
@@ -18,25 +19,57 @@
  * @value: pointer to array holding string
  * @list: node of a doubly-linked list
  *
- * @value needs to be explicitly allocated and freed
+ * @value needs to be explicitly allocated and freed. It always holds the plain
+ * string: no queue operation stores or reads compressed values. The compress
+ * command of qtest only measures symbol-table compression on a side copy.
  */
 typedef struct {
     char *value;
     struct list_head list;
 } element_t;
 
+/**
+ * q_index_t - Sampled search index over a sorted queue
+ * @slot: every Q_INDEX_STRIDE-th node of the queue, in list order
+ * @count: number of entries in @slot
+ * @cap: number of entries @slot has room for
+ * @descend: whether the queue is sorted in descending order
+ *
+ * An index with no @slot is empty, and searches fall back to a linear walk.
+ */
+typedef struct {
+    struct list_head **slot;
+    size_t count;
+    size_t cap;
+    bool descend;
+} q_index_t;
+
+/* Distance in nodes between two consecutive samples of an index */
+#define Q_INDEX_STRIDE 16
+
 /**
  * queue_contex_t - The context managing a chain of queues
  * @q: pointer to the head of the queue
  * @chain: used by chaining the heads of queues
  * @size: the length of this queue
  * @id: the unique identification number
+ * @sorted: 1 if known to be in ascending order, -1 if in descending order,
+ *          0 if the order is unknown
+ * @index: search index, only meaningful while @sorted is nonzero
+ * @tree: order-statistics tree over the nodes of @q, NULL until needed
+ * @filter: counting Bloom filter of the values in @q, NULL until needed
+ * @tag: harness tag charged with the memory allocated for @q, 0 if none
  */
 typedef struct {
     struct list_head *q;
     struct list_head chain;
-    int size;
+    size_t size;
     int id;
+    int sorted;
+    q_index_t index;
+    struct ostree *tree;
+    struct bloom *filter;
+    unsigned tag;
 } queue_contex_t;
 
 /* Operations on queue */
@@ -126,7 +159,7 @@ static inline void q_release_element(element_t *e)
  *
  * Return: the number of elements in queue, zero if queue is NULL or empty
  */
-int q_size(struct list_head *head);
+size_t q_size(struct list_head *head);
 
 /**
  * q_delete_mid() - Delete the middle node in queue
@@ -188,7 +221,7 @@ void q_reverse(struct list_head *head);
  * Reference:
  * https://leetcode.com/problems/reverse-nodes-in-k-group/
  */
-void q_reverseK(struct list_head *head, int k);
+void q_reverseK(struct list_head *head, size_t k);
 
 /**
  * q_sort() - Sort elements of queue in ascending/descending order
@@ -200,6 +233,67 @@ void q_reverseK(struct list_head *head, int k);
  */
 void q_sort(struct list_head *head, bool descend);
 
+/**
+ * q_key_t - Sort key of an element
+ * @num: compared first, as an unsigned number
+ * @str: compared next, with strcmp
+ * @buf: storage of @str when it is derived from the value, NULL otherwise
+ */
+typedef struct {
+    size_t num;
+    const char *str;
+    char *buf;
+} q_key_t;
+
+/**
+ * q_key_fn - Compute the sort key of a value
+ *
+ * Return: true for success, false if allocation failed
+ */
+typedef bool (*q_key_fn)(const char *value, q_key_t *key);
+
+/**
+ * q_key_cmp_fn - Compare two sort keys, returning a value less than, equal
+ * to, or greater than zero like strcmp
+ */
+typedef int (*q_key_cmp_fn)(const q_key_t *a, const q_key_t *b);
+
+/* Keys of the orders supported by q_sort_by() */
+bool q_key_plain(const char *value, q_key_t *key);
+bool q_key_natural(const char *value, q_key_t *key);
+bool q_key_nocase(const char *value, q_key_t *key);
+bool q_key_length(const char *value, q_key_t *key);
+
+/* Compare @num, then @str */
+int q_key_cmp(const q_key_t *a, const q_key_t *b);
+
+/* Release the storage of a key */
+void q_key_release(q_key_t *key);
+
+/**
+ * q_sort_by() - Sort elements of queue by a key computed once per element
+ * @head: header of queue
+ * @cmp: comparison of keys
+ * @key_fn: computation of the key of a value
+ * @descend: whether or not to sort in descending order
+ *
+ * The keys are computed in a side array before sorting with list_sort(), so an
+ * expensive key is derived n times instead of O(n log n) times, and the
+ * comparisons only look at the keys. The sort is stable. q_key_plain() gives
+ * the order of q_sort(). q_key_natural() compares runs of digits by their
+ * numeric value, so "file9" comes before "file10". q_key_nocase() ignores the
+ * case of letters. q_key_length() orders by length, then by strcmp.
+ *
+ * No effect if queue is NULL or empty.
+ *
+ * Return: true for success, false if allocation failed, in which case the
+ * queue is left unchanged
+ */
+bool q_sort_by(struct list_head *head,
+               q_key_cmp_fn cmp,
+               q_key_fn key_fn,
+               bool descend);
+
 /**
  * q_ascend() - Remove every node which has a node with a strictly less
  * value anywhere to the right side of it.
@@ -214,7 +308,7 @@ void q_sort(struct list_head *head, bool descend);
  *
  * Return: the number of elements in queue after performing operation
  */
-int q_ascend(struct list_head *head);
+size_t q_ascend(struct list_head *head);
 
 /**
  * q_descend() - Remove every node which has a node with a strictly greater
@@ -230,7 +324,7 @@ int q_ascend(struct list_head *head);
  *
  * Return: the number of elements in queue after performing operation
  */
-int q_descend(struct list_head *head);
+size_t q_descend(struct list_head *head);
 
 /**
  * q_merge() - Merge all the queues into one sorted queue, which is in
@@ -250,6 +344,216 @@ int q_descend(struct list_head *head);
  *
  * Return: the number of elements in queue after merging
  */
-int q_merge(struct list_head *head, bool descend);
+size_t q_merge(struct list_head *head, bool descend);
+
+/**
+ * q_split() - Move the beginning of a queue to the end of another queue
+ * @head: header of queue to split
+ * @k: number of elements to move
+ * @dst: header of queue receiving the elements
+ *
+ * The elements are moved as one sublist, in O(k) time to find the cutting
+ * point. The whole queue is moved if it has fewer than @k elements.
+ *
+ * Return: the number of elements moved
+ */
+size_t q_split(struct list_head *head, size_t k, struct list_head *dst);
+
+/**
+ * q_rotate() - Rotate a queue
+ * @head: header of queue
+ * @k: number of elements to move from the beginning to the end, or from the
+ *     end to the beginning if negative
+ *
+ * Rotating by a multiple of the queue size has no effect. Only the cutting
+ * point is searched for, so this takes O(|k|) time, bounded by the queue size.
+ */
+void q_rotate(struct list_head *head, ssize_t k);
+
+/**
+ * q_concat() - Append a queue to another queue
+ * @dst: header of queue receiving the elements
+ * @src: header of queue to empty
+ *
+ * No effect if @dst and @src are the same queue. This takes constant time.
+ */
+void q_concat(struct list_head *dst, struct list_head *src);
+
+/**
+ * q_defrag() - Move the elements of a queue into fresh storage
+ * @head: header of queue
+ *
+ * Every element and its string are copied into new blocks, allocated one after
+ * the other in list order, and the old blocks are released as soon as they
+ * are copied, so memory in use grows by one element at most. Consecutive
+ * elements sit next to each other in memory when the allocator does not hand
+ * out the released blocks again, as the test harness arranges. The order of
+ * the queue does not change, but pointers to its elements are no longer
+ * valid.
+ *
+ * Return: true if successful, false if queue is NULL or allocation failed, in
+ * which case only the elements before the failure have moved
+ */
+bool q_defrag(struct list_head *head);
+
+/**
+ * q_topk() - Move the k smallest or largest elements into another queue
+ * @head: header of queue
+ * @k: number of elements to select
+ * @dst: header of an empty queue receiving the selected elements
+ * @descend: whether to select the largest elements instead of the smallest
+ *
+ * The selected elements end up in @dst sorted in the requested order. They are
+ * kept in a bounded heap threaded through their own list nodes, so this takes
+ * O(n log k) comparisons and does not allocate. The other elements stay in
+ * @head, though not necessarily in their original order.
+ *
+ * Return: the number of elements moved into @dst
+ */
+size_t q_topk(struct list_head *head,
+              size_t k,
+              struct list_head *dst,
+              bool descend);
+
+/**
+ * q_nth() - Find the k-th element in sorted order without sorting
+ * @head: header of queue
+ * @k: 0-based rank of the element in ascending/descending order
+ * @descend: whether to rank in descending order
+ *
+ * Quickselect partitions the list around random pivots, which takes expected
+ * O(n) comparisons and does not allocate. Elements are left partitioned
+ * around the returned one.
+ *
+ * Return: the element of rank @k, NULL if queue is NULL or @k is out of range
+ */
+element_t *q_nth(struct list_head *head, size_t k, bool descend);
+
+/**
+ * q_group_t - A distinct value of a queue and its number of occurrences
+ * @first: the first element holding the value
+ * @count: number of elements holding the value
+ */
+typedef struct {
+    element_t *first;
+    size_t count;
+} q_group_t;
+
+/**
+ * q_groupby() - Count the elements holding each distinct value
+ * @head: header of queue
+ * @top: array receiving the groups with the most elements, largest first
+ * @ntop: capacity of @top
+ * @rewrite: whether to delete all but the first element of each group
+ *
+ * Values are counted with an open-addressing hash table of 24 bytes per slot,
+ * kept at most half full and capped at 2^20 slots, so scratch space is at
+ * most 24 MiB whatever the length of the queue. Up to 2^19 distinct values
+ * are counted in one pass. Beyond that, each pass counts the values whose hash
+ * falls in a range narrowed to fit the table, and the queue is walked once per
+ * range. Groups with the same count are ranked by value. With @rewrite, the
+ * queue is left with one element per distinct value, in first-seen order.
+ *
+ * Return: the number of distinct values, -1 if queue is NULL or allocation
+ * failed
+ */
+ssize_t q_groupby(struct list_head *head,
+                  q_group_t *top,
+                  size_t ntop,
+                  bool rewrite);
+
+/**
+ * q_union() - Add to a queue the values of another queue it lacks
+ * @head: header of queue receiving the values
+ * @other: header of queue giving its elements
+ *
+ * Elements of @other whose value is not yet in @head are moved into @head,
+ * the others are deleted, so @other ends up empty. If both queues are sorted
+ * in the same order, the elements are merged in a single walk and @head stays
+ * sorted. Otherwise the values of @head are hashed and new ones are appended
+ * in their order in @other, with the same bound on the table as q_groupby().
+ * The table is filled before any element is moved or deleted, so if allocation
+ * fails both queues are left as they were.
+ *
+ * Return: the number of elements in @head, -1 if a queue is NULL or
+ * allocation failed
+ */
+ssize_t q_union(struct list_head *head, struct list_head *other);
+
+/**
+ * q_intersect() - Keep the elements whose value is also in another queue
+ * @head: header of queue to filter
+ * @other: header of queue holding the values to keep
+ *
+ * Deleted elements are released, and @other is not modified. As with
+ * q_union(), a merge walk is used when both queues are sorted in the same
+ * order, and a hash table of the values of @other otherwise. As there, both
+ * queues are left as they were if allocation fails.
+ *
+ * Return: the number of elements in @head, -1 if a queue is NULL or
+ * allocation failed
+ */
+ssize_t q_intersect(struct list_head *head, struct list_head *other);
+
+/**
+ * q_diff() - Delete the elements whose value is in another queue
+ * @head: header of queue to filter
+ * @other: header of queue holding the values to delete
+ *
+ * Same strategy as q_intersect(), keeping the opposite elements.
+ *
+ * Return: the number of elements in @head, -1 if a queue is NULL or
+ * allocation failed
+ */
+ssize_t q_diff(struct list_head *head, struct list_head *other);
+
+/**
+ * q_index_build() - Build the search index of a sorted queue
+ * @head: header of queue
+ * @idx: index to be (re)built
+ * @descend: whether the queue is sorted in descending order
+ *
+ * Any previous content of @idx is released first.
+ *
+ * Return: true for success, false if allocation failed, in which case @idx is
+ * left empty.
+ */
+bool q_index_build(struct list_head *head, q_index_t *idx, bool descend);
+
+/**
+ * q_index_free() - Release the storage of a search index
+ * @idx: index to be emptied
+ *
+ * The index must be emptied whenever nodes are removed from its queue, since
+ * it may refer to them.
+ */
+void q_index_free(q_index_t *idx);
+
+/**
+ * q_find() - Find an element holding the given string
+ * @head: header of queue
+ * @idx: search index of the sorted queue, or NULL if the queue is unsorted
+ * @s: string to look for
+ *
+ * With a non-empty index this takes O(log n) comparisons to locate the
+ * sampled node preceding @s, followed by a walk of about Q_INDEX_STRIDE nodes.
+ * Otherwise the whole queue is scanned.
+ *
+ * Return: the first element equal to @s, NULL if there is none.
+ */
+element_t *q_find(struct list_head *head, const q_index_t *idx, const char *s);
+
+/**
+ * q_insert_sorted() - Insert an element keeping the queue sorted
+ * @head: header of queue sorted in the order recorded by @idx
+ * @idx: search index of the queue, possibly empty
+ * @s: string would be inserted
+ *
+ * The new element is placed after any element equal to @s. The index stays
+ * usable: a bucket grown to twice Q_INDEX_STRIDE nodes is split in two.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_sorted(struct list_head *head, q_index_t *idx, char *s);
 
 #endif /* LAB0_QUEUE_H */
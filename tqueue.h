@@ -0,0 +1,203 @@
+#ifndef LAB0_TQUEUE_H
+#define LAB0_TQUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "list.h"
+
+/* Generator of type-specialized queues built on list.h.
+ *
+ * DECLARE_QUEUE(name, T, cmp) emits an entry type name##_element_t holding a
+ * value of type T, and static inline operations on queues of such entries:
+ *
+ *   struct list_head *name##_new(void);
+ *   void name##_free(struct list_head *head);
+ *   size_t name##_size(struct list_head *head);
+ *   bool name##_insert_head(struct list_head *head, T value);
+ *   bool name##_insert_tail(struct list_head *head, T value);
+ *   bool name##_remove_head(struct list_head *head, T *value);
+ *   bool name##_remove_tail(struct list_head *head, T *value);
+ *   void name##_sort(struct list_head *head, bool descend);
+ *   void name##_merge(struct list_head *dst, struct list_head *src,
+ *                     bool descend);
+ *
+ * cmp must be a function or macro taking two values of type T, and returning
+ * a negative, zero or positive int like strcmp. It is called directly, so a
+ * static inline comparator is inlined into the loops of name##_merge() and of
+ * name##_sort(). The latter is the stable bottom-up merge sort of list_sort(),
+ * repeated here so that no comparison goes through a function pointer.
+ *
+ * Entries are allocated with malloc and released with free. harness.h only
+ * redirects those to the test allocator in files not defining INTERNAL, so the
+ * numeric queues of qtest.c use the C library directly and are not tracked.
+ */
+
+#define DECLARE_QUEUE(name, T, cmp)                                           \
+    typedef struct {                                                          \
+        T value;                                                              \
+        struct list_head list;                                                \
+    } name##_element_t;                                                       \
+                                                                              \
+    static inline T name##_value(const struct list_head *node)                \
+    {                                                                         \
+        return list_entry(node, name##_element_t, list)->value;               \
+    }                                                                         \
+                                                                              \
+    /* Create an empty queue. Return NULL if allocation failed */             \
+    static inline struct list_head *name##_new(void)                          \
+    {                                                                         \
+        struct list_head *head = malloc(sizeof(struct list_head));            \
+        if (head)                                                             \
+            INIT_LIST_HEAD(head);                                             \
+        return head;                                                          \
+    }                                                                         \
+                                                                              \
+    /* Free all storage used by queue, no effect if head is NULL */           \
+    static inline void name##_free(struct list_head *head)                    \
+    {                                                                         \
+        if (!head)                                                            \
+            return;                                                           \
+        name##_element_t *entry, *safe;                                       \
+        list_for_each_entry_safe (entry, safe, head, list)                    \
+            free(entry);                                                      \
+        free(head);                                                           \
+    }                                                                         \
+                                                                              \
+    static inline size_t name##_size(struct list_head *head)                  \
+    {                                                                         \
+        size_t n = 0;                                                         \
+        struct list_head *node;                                               \
+        if (head)                                                             \
+            list_for_each (node, head)                                        \
+                n++;                                                          \
+        return n;                                                             \
+    }                                                                         \
+                                                                              \
+    static inline bool name##_insert_head(struct list_head *head, T value)    \
+    {                                                                         \
+        name##_element_t *e;                                                  \
+        if (!head || !(e = malloc(sizeof(name##_element_t))))                 \
+            return false;                                                     \
+        e->value = value;                                                     \
+        list_add(&e->list, head);                                             \
+        return true;                                                          \
+    }                                                                         \
+                                                                              \
+    static inline bool name##_insert_tail(struct list_head *head, T value)    \
+    {                                                                         \
+        name##_element_t *e;                                                  \
+        if (!head || !(e = malloc(sizeof(name##_element_t))))                 \
+            return false;                                                     \
+        e->value = value;                                                     \
+        list_add_tail(&e->list, head);                                        \
+        return true;                                                          \
+    }                                                                         \
+                                                                              \
+    /* Remove and free the node, storing its value if value is not NULL */    \
+    static inline bool name##_remove(struct list_head *head,                  \
+                                     struct list_head *node, T *value)        \
+    {                                                                         \
+        if (!head || list_empty(head))                                        \
+            return false;                                                     \
+        name##_element_t *e = list_entry(node, name##_element_t, list);       \
+        if (value)                                                            \
+            *value = e->value;                                                \
+        list_del(node);                                                       \
+        free(e);                                                              \
+        return true;                                                          \
+    }                                                                         \
+                                                                              \
+    static inline bool name##_remove_head(struct list_head *head, T *value)   \
+    {                                                                         \
+        return head && name##_remove(head, head->next, value);                \
+    }                                                                         \
+                                                                              \
+    static inline bool name##_remove_tail(struct list_head *head, T *value)   \
+    {                                                                         \
+        return head && name##_remove(head, head->prev, value);                \
+    }                                                                         \
+                                                                              \
+    /* Merge two sorted NULL-terminated lists linked by next; a wins ties */  \
+    static inline struct list_head *name##_sort_merge(                        \
+        struct list_head *a, struct list_head *b, bool descend)               \
+    {                                                                         \
+        struct list_head *head = NULL, **tail = &head;                        \
+        for (;;) {                                                            \
+            int r = cmp(name##_value(a), name##_value(b));                    \
+            struct list_head **node = (descend ? r >= 0 : r <= 0) ? &a : &b;  \
+            *tail = *node;                                                    \
+            tail = &(*node)->next;                                            \
+            *node = (*node)->next;                                            \
+            if (!*node)                                                       \
+                break;                                                        \
+        }                                                                     \
+        *tail = (struct list_head *) ((uintptr_t) a | (uintptr_t) b);         \
+        return head;                                                          \
+    }                                                                         \
+                                                                              \
+    /* Stable bottom-up merge sort: list_sort() of list.h with cmp inlined */ \
+    static inline void name##_sort(struct list_head *head, bool descend)      \
+    {                                                                         \
+        if (!head || head->next == head->prev)                                \
+            return;                                                           \
+        struct list_head *list = head->next, *pending = NULL;                 \
+        size_t count = 0;                                                     \
+        head->prev->next = NULL;                                              \
+        do {                                                                  \
+            size_t bits;                                                      \
+            struct list_head **tail = &pending;                               \
+            for (bits = count; bits & 1; bits >>= 1)                          \
+                tail = &(*tail)->prev;                                        \
+            if (bits) {                                                       \
+                struct list_head *a = *tail, *b = a->prev;                    \
+                a = name##_sort_merge(b, a, descend);                         \
+                a->prev = b->prev;                                            \
+                *tail = a;                                                    \
+            }                                                                 \
+            list->prev = pending;                                             \
+            pending = list;                                                   \
+            list = list->next;                                                \
+            pending->next = NULL;                                             \
+            count++;                                                          \
+        } while (list);                                                       \
+                                                                              \
+        /* Merge all pending sublists, most recent first */                   \
+        list = pending;                                                       \
+        pending = pending->prev;                                              \
+        while (pending->prev) {                                               \
+            struct list_head *next = pending->prev;                           \
+            list = name##_sort_merge(pending, list, descend);                 \
+            pending = next;                                                   \
+        }                                                                     \
+        list = name##_sort_merge(pending, list, descend);                     \
+                                                                              \
+        /* Restore the prev links and the circular structure */               \
+        struct list_head *prev = head;                                        \
+        for (head->next = list; list; prev = list, list = list->next)         \
+            list->prev = prev;                                                \
+        prev->next = head;                                                    \
+        head->prev = prev;                                                    \
+    }                                                                         \
+                                                                              \
+    /* Merge sorted queue src into sorted queue dst, leaving src empty */     \
+    static inline void name##_merge(struct list_head *dst,                    \
+                                    struct list_head *src, bool descend)      \
+    {                                                                         \
+        if (!dst || !src || dst == src)                                       \
+            return;                                                           \
+        struct list_head *pos = dst->next, *node, *safe;                      \
+        list_for_each_safe (node, safe, src) {                                \
+            T v = name##_value(node);                                         \
+            while (pos != dst) {                                              \
+                int r = cmp(v, name##_value(pos));                            \
+                if (descend ? r > 0 : r < 0)                                  \
+                    break;                                                    \
+                pos = pos->next;                                              \
+            }                                                                 \
+            list_move_tail(node, pos);                                        \
+        }                                                                     \
+    }
+
+#endif /* LAB0_TQUEUE_H */
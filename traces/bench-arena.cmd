@@ -0,0 +1,20 @@
+# Time traversal and sort of 1M nodes allocated with malloc, then allocated
+# from huge page arenas, and report the huge page coverage of the arenas.
+option fail 0
+option malloc 0
+option timelimit 10
+new
+it RAND 500000
+it RAND 500000
+time sort
+time size 10
+free
+option arena 1
+new
+it RAND 500000
+it RAND 500000
+time sort
+time size 10
+arena
+free
+option arena 0
@@ -0,0 +1,15 @@
+# Time 1M insertions with allocation failures scheduled, and show how many
+# calls failed at each call site. Failures are the same on every run.
+option fail 1000000
+option malloc 0
+option timelimit 10
+new
+time it RAND 1000000
+fault every 1000
+time it RAND 1000000
+fault
+fault random 1
+time it RAND 1000000
+fault
+fault off
+free
@@ -0,0 +1,15 @@
+# Compare the string queue with the numeric queue generated by DECLARE_QUEUE
+option fail 0
+option malloc 0
+new
+time it RAND 200000
+time itn RAND 200000
+free
+freen
+new
+time it RAND 10000
+time sort
+time itn RAND 10000
+time sortn
+free
+freen
@@ -0,0 +1,27 @@
+# Time sorting 1M nodes with different comparators
+option fail 0
+option malloc 0
+option timelimit 10
+itn RAND 1000000
+time sortn
+option descend 1
+time sortn
+option descend 0
+freen
+new
+it RAND 500000
+it RAND 500000
+time sort
+option descend 1
+time sort
+option descend 0
+it dolphin 10
+time sort
+option sortkey 1
+time sort
+option sortkey 2
+time sort
+option sortkey 3
+time sort
+option sortkey 0
+free
@@ -0,0 +1,28 @@
+# Time traversals over nodes scattered in memory by sorting random strings.
+# Compare with a build without prefetching: make clean; make PREFETCH=0 bench
+# Each queue is timed again after defrag lays its nodes out in queue order.
+option fail 0
+option malloc 0
+option timelimit 10
+new
+it RAND 10000
+sort
+time size 10
+defrag
+time size 10
+free
+new
+it RAND 100000
+sort
+time size 10
+defrag
+time size 10
+free
+new
+it RAND 500000
+it RAND 500000
+sort
+time size 10
+defrag
+time size 10
+free
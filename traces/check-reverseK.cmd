@@ -0,0 +1,58 @@
+# reverseK reverses every group of k elements and leaves a shorter last group
+# in place, whether the list or the order-statistics tree serves it
+option ostree 0
+new
+ih dolphin
+ih bear
+ih gerbil
+ih meerkat
+ih bear
+ih gerbil
+ih vulture
+ih newt
+reverseK 3
+rh gerbil
+rh vulture
+rh newt
+rh gerbil
+rh meerkat
+rh bear
+rh bear
+rh dolphin
+it a
+it b
+it c
+reverseK 3
+reverseK 4
+rh c
+rh b
+rh a
+free
+option ostree 1
+new
+ih dolphin
+ih bear
+ih gerbil
+ih meerkat
+ih bear
+ih gerbil
+ih vulture
+ih newt
+reverseK 3
+rh gerbil
+rh vulture
+rh newt
+rh gerbil
+rh meerkat
+rh bear
+rh bear
+rh dolphin
+it a
+it b
+it c
+reverseK 3
+reverseK 4
+rh c
+rh b
+rh a
+free
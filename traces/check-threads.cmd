@@ -0,0 +1,16 @@
+# Allocate and free from several threads at once, each thread freeing blocks
+# of the others, with every kind of block
+option malloc 0
+threads 8 100000
+option arena 1
+threads 8 100000
+option arena 0
+option compact 1
+threads 8 100000
+option compact 0
+option quarantine 64
+option poison 2
+threads 8 100000
+option quarantine 0
+option guard 256
+threads 4 10000